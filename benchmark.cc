@@ -0,0 +1,512 @@
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "pb.c"
+#include "benchmark.h"
+
+using pb_benchmark::no_optimize;
+
+// mix aligned and unaligned
+static const u64 unaligned_blocks[] = {64, 65, 128, 129};
+
+static void benchmark_arena_unaligned(pb_benchmark::State& state, enum AllocatorType type) {
+  Allocator allocator = pb_allocator_create(type, state.iterations * 130 + 4096);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    void* p = pb_arena_push_no_zero(&allocator, unaligned_blocks[i % 4]);
+    no_optimize(p);
+  }
+  state.stop();
+  pb_arena_release(&allocator);
+}
+
+PB_BENCHMARK(arena_unaligned, 10000000) {
+  benchmark_arena_unaligned(state, PB_ALLOCATOR_ARENA);
+}
+
+PB_BENCHMARK(arena_growable_unaligned, 10000000) {
+  benchmark_arena_unaligned(state, PB_ALLOCATOR_ARENA_GROWABLE);
+}
+
+PB_BENCHMARK(malloc_unaligned, 10000000) {
+  std::vector<void*> pointers(state.iterations);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    void* p = malloc(unaligned_blocks[i % 4]);
+    no_optimize(p);
+    pointers[i] = p;
+  }
+  state.stop();
+  for (void* p : pointers) {
+    free(p);
+  }
+}
+
+PB_BENCHMARK(pool_unaligned, 10000000) {
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+  std::vector<void*> pointers(state.iterations);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    void* p = allocator.allocate(&allocator, unaligned_blocks[i % 4]);
+    no_optimize(p);
+    pointers[i] = p;
+  }
+  state.stop();
+  pb_pool_release(&allocator);
+}
+
+// new/delete style churn, a window of live objects freed in allocation order
+PB_BENCHMARK(malloc_churn, 10000000) {
+  void* window[256] = {0};
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    free(window[i % 256]);
+    window[i % 256] = malloc(unaligned_blocks[i % 4]);
+    no_optimize(window[i % 256]);
+  }
+  state.stop();
+  for (u64 i = 0; i < 256; i++) {
+    free(window[i]);
+  }
+}
+
+PB_BENCHMARK(pool_churn, 10000000) {
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+  void* window[256] = {0};
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    allocator.deallocate(&allocator, window[i % 256]);
+    window[i % 256] = allocator.allocate(&allocator, unaligned_blocks[i % 4]);
+    no_optimize(window[i % 256]);
+  }
+  state.stop();
+  pb_pool_release(&allocator);
+}
+
+// Cost of per call site accounting on top of the system allocator
+static void benchmark_tracking_churn(pb_benchmark::State& state, bool tracked) {
+  Allocator system = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+  Allocator tracking = pb_tracking_allocator_create(&system);
+  Allocator* allocator = tracked ? &tracking : &system;
+  void* window[256] = {0};
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    allocator->deallocate(allocator, window[i % 256]);
+    window[i % 256] = allocator->allocate(allocator, unaligned_blocks[i % 4]);
+    no_optimize(window[i % 256]);
+  }
+  state.stop();
+  for (u64 i = 0; i < 256; i++) {
+    allocator->deallocate(allocator, window[i]);
+  }
+  pb_tracking_allocator_release(&tracking);
+}
+
+PB_BENCHMARK(system_churn, 10000000) { benchmark_tracking_churn(state, false); }
+PB_BENCHMARK(tracking_churn, 10000000) { benchmark_tracking_churn(state, true); }
+
+PB_BENCHMARK(allocator_vtable, 100000000) {
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, state.iterations * 16);
+  Allocator* dynamic = &allocator;
+  // keep the compiler from devirtualizing the function pointer
+  no_optimize(dynamic);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    void* p = pb_allocate(dynamic, 16);
+    no_optimize(p);
+  }
+  state.stop();
+  pb_arena_release(&allocator);
+}
+
+PB_BENCHMARK(allocator_inline, 100000000) {
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, state.iterations * 16);
+  Arena* arena = pb_allocator_arena_get(&allocator);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    void* p = pb_allocate(arena, 16);
+    no_optimize(p);
+  }
+  state.stop();
+  pb_arena_release(&allocator);
+}
+
+// Iterations are bytes, so metrics read as per byte, and the bytes column is bytes per cycle
+static const u64 fill_bytes = 256 * 1024 * 1024;
+
+template <typename Kernel>
+static void benchmark_fill(pb_benchmark::State& state, u64 size, Kernel kernel) {
+  u8* source = (u8*)malloc(size);
+  u8* destination = (u8*)malloc(size);
+  memset(source, 1, size);
+  memset(destination, 1, size);
+  state.start();
+  for (u64 i = 0; i < state.iterations / size; i++) {
+    kernel(destination, source, size, (u8)i);
+    no_optimize(destination);
+  }
+  state.stop();
+  state.set_bytes(state.iterations / size * size);
+  free(source);
+  free(destination);
+}
+
+#define BENCHMARK_FILL(size) \
+  PB_BENCHMARK(memset_libc_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { memset(d, v, n); }); \
+  } \
+  PB_BENCHMARK(memset_pb_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memset(d, v, n); }); \
+  } \
+  PB_BENCHMARK(memset_sse2_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memset_sse2(d, v, n); }); \
+  } \
+  PB_BENCHMARK(memset_avx2_##size, fill_bytes) { \
+    if (!__builtin_cpu_supports("avx2")) { state.skip("no avx2"); return; } \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memset_avx2(d, v, n); }); \
+  } \
+  PB_BENCHMARK(memcpy_libc_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { memcpy(d, s, n); }); \
+  } \
+  PB_BENCHMARK(memcpy_pb_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memcpy(d, s, n); }); \
+  } \
+  PB_BENCHMARK(memcpy_sse2_##size, fill_bytes) { \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memcpy_sse2(d, s, n); }); \
+  } \
+  PB_BENCHMARK(memcpy_avx2_##size, fill_bytes) { \
+    if (!__builtin_cpu_supports("avx2")) { state.skip("no avx2"); return; } \
+    benchmark_fill(state, size, [](u8* d, u8* s, u64 n, u8 v) { pb_memcpy_avx2(d, s, n); }); \
+  }
+
+BENCHMARK_FILL(64)
+BENCHMARK_FILL(4096)
+BENCHMARK_FILL(1048576)
+
+struct ConcurrentArenaThreadArgs {
+  Allocator* allocator;
+  pthread_mutex_t* mutex;
+  u64 allocations;
+};
+
+static void* benchmark_concurrent_arena_thread(void* ctx) {
+  ConcurrentArenaThreadArgs* args = (ConcurrentArenaThreadArgs*)ctx;
+  for (u64 i = 0; i < args->allocations; i++) {
+    if (args->mutex) {
+      pthread_mutex_lock(args->mutex);
+    }
+    void* p = args->allocator->allocate(args->allocator, 64);
+    if (args->mutex) {
+      pthread_mutex_unlock(args->mutex);
+    }
+    no_optimize(p);
+  }
+  return NULL;
+}
+
+// Counters are per thread, only tsc (wall time) is meaningful here
+static void benchmark_concurrent_arena(pb_benchmark::State& state, u64 thread_count, bool locked) {
+  Allocator allocator = locked ?
+    pb_allocator_create(PB_ALLOCATOR_ARENA, state.iterations * 64 + 4096) :
+    pb_allocator_create(PB_ALLOCATOR_CONCURRENT_ARENA, state.iterations * 64 + thread_count * 2 * PB_CONCURRENT_ARENA_CHUNK_SIZE);
+  pthread_mutex_t mutex;
+  pthread_mutex_init(&mutex, NULL);
+  ConcurrentArenaThreadArgs args = {&allocator, locked ? &mutex : NULL, state.iterations / thread_count};
+  pthread_t threads[8];
+  state.start();
+  for (u64 i = 0; i < thread_count; i++) {
+    pthread_create(&threads[i], NULL, benchmark_concurrent_arena_thread, &args);
+  }
+  for (u64 i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  state.stop();
+  if (locked) {
+    pb_arena_release(&allocator);
+  } else {
+    pb_concurrent_arena_release(&allocator);
+  }
+  pthread_mutex_destroy(&mutex);
+}
+
+PB_BENCHMARK(concurrent_arena_1_thread, 10000000) { benchmark_concurrent_arena(state, 1, false); }
+PB_BENCHMARK(concurrent_arena_4_threads, 10000000) { benchmark_concurrent_arena(state, 4, false); }
+PB_BENCHMARK(concurrent_arena_8_threads, 10000000) { benchmark_concurrent_arena(state, 8, false); }
+PB_BENCHMARK(mutex_arena_1_thread, 10000000) { benchmark_concurrent_arena(state, 1, true); }
+PB_BENCHMARK(mutex_arena_4_threads, 10000000) { benchmark_concurrent_arena(state, 4, true); }
+PB_BENCHMARK(mutex_arena_8_threads, 10000000) { benchmark_concurrent_arena(state, 8, true); }
+
+// 64MB, well past the last level cache, so reads and the pointer chase go to
+// the memory of the node the arena is bound to. Remote is the next node, with
+// a single node it is the local one and both pairs measure the same thing.
+#define NUMA_BUFFER_SIZE (64ULL * 1024 * 1024)
+#define NUMA_LINE 64
+
+static Allocator benchmark_numa_buffer(bool remote) {
+  u32 node = pb_numa_current_node();
+  if (remote) {
+    node = (node + 1) % pb_numa_node_count();
+  }
+  NumaPolicy policy = {PB_NUMA_BIND, node};
+  return pb_allocator_create_numa(PB_ALLOCATOR_ARENA, NUMA_BUFFER_SIZE, policy);
+}
+
+// Per iteration is one u64 read
+static void benchmark_numa_read(pb_benchmark::State& state, bool remote) {
+  Allocator allocator = benchmark_numa_buffer(remote);
+  u64* data = (u64*)allocator.allocate(&allocator, NUMA_BUFFER_SIZE);
+  for (u64 i = 0; i < NUMA_BUFFER_SIZE / 8; i++) {
+    data[i] = i;
+  }
+  u64 sum = 0;
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    sum += data[i % (NUMA_BUFFER_SIZE / 8)];
+  }
+  state.stop();
+  no_optimize(sum);
+  pb_arena_release(&allocator);
+}
+
+// Per iteration is one dependent load of a line in random order
+static void benchmark_numa_chase(pb_benchmark::State& state, bool remote) {
+  Allocator allocator = benchmark_numa_buffer(remote);
+  u64 lines = NUMA_BUFFER_SIZE / NUMA_LINE;
+  u8* data = (u8*)allocator.allocate(&allocator, NUMA_BUFFER_SIZE);
+  std::vector<u64> order(lines);
+  for (u64 i = 0; i < lines; i++) {
+    order[i] = i;
+  }
+  u64 random = 0x9e3779b97f4a7c15ULL;
+  for (u64 i = lines - 1; i > 0; i--) {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    std::swap(order[i], order[random % (i + 1)]);
+  }
+  for (u64 i = 0; i < lines; i++) {
+    *(u8**)(data + order[i] * NUMA_LINE) = data + order[(i + 1) % lines] * NUMA_LINE;
+  }
+  u8* p = data + order[0] * NUMA_LINE;
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    p = *(u8**)p;
+  }
+  state.stop();
+  no_optimize(p);
+  pb_arena_release(&allocator);
+}
+
+PB_BENCHMARK(numa_local_read, 8388608) { benchmark_numa_read(state, false); }
+PB_BENCHMARK(numa_remote_read, 8388608) { benchmark_numa_read(state, true); }
+PB_BENCHMARK(numa_local_chase, 1048576) { benchmark_numa_chase(state, false); }
+PB_BENCHMARK(numa_remote_chase, 1048576) { benchmark_numa_chase(state, true); }
+
+PB_BENCHMARK(vector_push, 10000000) {
+  std::vector<u64> vector;
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    vector.push_back(i);
+  }
+  state.stop();
+}
+
+static void benchmark_dynamic_array_push(pb_benchmark::State& state, enum AllocatorType type) {
+  Allocator allocator = pb_allocator_create(type, 4ULL * 1024 * 1024 * 1024);
+  DynamicArray(u64) array;
+  pb_dynamic_array_init(array, &allocator, 8);
+  state.start();
+  for (u64 i = 0; i < state.iterations; i++) {
+    pb_dynamic_array_push(array, i);
+  }
+  state.stop();
+  if (type == PB_ALLOCATOR_ARENA_GROWABLE) {
+    pb_arena_release(&allocator);
+  } else {
+    pb_dynamic_array_release(array, &allocator);
+    if (type == PB_ALLOCATOR_POOL) {
+      pb_pool_release(&allocator);
+    }
+  }
+}
+
+// arena grows in place, system mremaps, pool copies
+PB_BENCHMARK(dynamic_array_push_arena, 10000000) { benchmark_dynamic_array_push(state, PB_ALLOCATOR_ARENA_GROWABLE); }
+PB_BENCHMARK(dynamic_array_push_system, 10000000) { benchmark_dynamic_array_push(state, PB_ALLOCATOR_SYSTEM); }
+PB_BENCHMARK(dynamic_array_push_pool, 10000000) { benchmark_dynamic_array_push(state, PB_ALLOCATOR_POOL); }
+
+static std::vector<u64> benchmark_keys(u64 count) {
+  std::vector<u64> keys(count);
+  u64 seed = 0x12345678;
+  for (u64 i = 0; i < count; i++) {
+    seed = pb_hash_u64(seed + i);
+    keys[i] = seed;
+  }
+  return keys;
+}
+
+static std::vector<std::string> benchmark_string_keys(u64 count) {
+  std::vector<u64> keys = benchmark_keys(count);
+  std::vector<std::string> string_keys(count);
+  for (u64 i = 0; i < count; i++) {
+    string_keys[i] = "anchor_" + std::to_string(keys[i]);
+  }
+  return string_keys;
+}
+
+enum HashMapOperation {
+  HASH_MAP_INSERT,
+  HASH_MAP_LOOKUP,
+  HASH_MAP_ITERATE,
+};
+
+// lookups go in a different order than inserts so node allocation order doesn't help
+static void benchmark_unordered_map_u64(pb_benchmark::State& state, HashMapOperation operation) {
+  u64 count = state.iterations;
+  std::vector<u64> keys = benchmark_keys(count);
+  std::unordered_map<u64, u64> map;
+  u64 sum = 0;
+  state.start();
+  for (u64 i = 0; i < count; i++) {
+    map[keys[i]] = i;
+  }
+  if (operation == HASH_MAP_INSERT) {
+    state.stop();
+  } else if (operation == HASH_MAP_LOOKUP) {
+    state.start();
+    for (u64 i = 0; i < count; i++) {
+      sum += map.find(keys[(i * 7919) % count])->second;
+    }
+    state.stop();
+  } else {
+    state.start();
+    for (auto& it : map) {
+      sum += it.second;
+    }
+    state.stop();
+  }
+  no_optimize(sum);
+}
+
+static void benchmark_hash_map_u64(pb_benchmark::State& state, HashMapOperation operation) {
+  u64 count = state.iterations;
+  std::vector<u64> keys = benchmark_keys(count);
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+  HashMap map;
+  pb_hash_map_init(&map, &allocator, PB_HASH_MAP_KEY_U64, sizeof(u64), 0);
+  u64 sum = 0;
+  state.start();
+  for (u64 i = 0; i < count; i++) {
+    *(u64*)pb_hash_map_put_u64(&map, keys[i]) = i;
+  }
+  if (operation == HASH_MAP_INSERT) {
+    state.stop();
+  } else if (operation == HASH_MAP_LOOKUP) {
+    state.start();
+    for (u64 i = 0; i < count; i++) {
+      sum += *(u64*)pb_hash_map_get_u64(&map, keys[(i * 7919) % count]);
+    }
+    state.stop();
+  } else {
+    state.start();
+    pb_hash_map_for_each(&map, i) {
+      sum += *(u64*)pb_hash_map_value(&map, i);
+    }
+    state.stop();
+  }
+  no_optimize(sum);
+  pb_hash_map_release(&map);
+}
+
+static void benchmark_unordered_map_string(pb_benchmark::State& state, HashMapOperation operation) {
+  u64 count = state.iterations;
+  std::vector<std::string> keys = benchmark_string_keys(count);
+  std::unordered_map<std::string, u64> map;
+  u64 sum = 0;
+  state.start();
+  for (u64 i = 0; i < count; i++) {
+    map[keys[i]] = i;
+  }
+  if (operation == HASH_MAP_INSERT) {
+    state.stop();
+  } else if (operation == HASH_MAP_LOOKUP) {
+    state.start();
+    for (u64 i = 0; i < count; i++) {
+      sum += map.find(keys[(i * 7919) % count])->second;
+    }
+    state.stop();
+  } else {
+    state.start();
+    for (auto& it : map) {
+      sum += it.second;
+    }
+    state.stop();
+  }
+  no_optimize(sum);
+}
+
+static void benchmark_hash_map_string(pb_benchmark::State& state, HashMapOperation operation) {
+  u64 count = state.iterations;
+  std::vector<std::string> keys = benchmark_string_keys(count);
+  Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1ULL << 32);
+  HashMap map;
+  pb_hash_map_init(&map, &allocator, PB_HASH_MAP_KEY_STRING, sizeof(u64), 0);
+  u64 sum = 0;
+  state.start();
+  for (u64 i = 0; i < count; i++) {
+    *(u64*)pb_hash_map_put_string(&map, keys[i].data(), keys[i].size()) = i;
+  }
+  if (operation == HASH_MAP_INSERT) {
+    state.stop();
+  } else if (operation == HASH_MAP_LOOKUP) {
+    state.start();
+    for (u64 i = 0; i < count; i++) {
+      const std::string& key = keys[(i * 7919) % count];
+      sum += *(u64*)pb_hash_map_get_string(&map, key.data(), key.size());
+    }
+    state.stop();
+  } else {
+    state.start();
+    pb_hash_map_for_each(&map, i) {
+      sum += *(u64*)pb_hash_map_value(&map, i);
+    }
+    state.stop();
+  }
+  no_optimize(sum);
+  pb_arena_release(&allocator);
+}
+
+PB_BENCHMARK(unordered_map_u64_insert, 1000000) { benchmark_unordered_map_u64(state, HASH_MAP_INSERT); }
+PB_BENCHMARK(unordered_map_u64_lookup, 1000000) { benchmark_unordered_map_u64(state, HASH_MAP_LOOKUP); }
+PB_BENCHMARK(unordered_map_u64_iterate, 1000000) { benchmark_unordered_map_u64(state, HASH_MAP_ITERATE); }
+PB_BENCHMARK(hash_map_u64_insert, 1000000) { benchmark_hash_map_u64(state, HASH_MAP_INSERT); }
+PB_BENCHMARK(hash_map_u64_lookup, 1000000) { benchmark_hash_map_u64(state, HASH_MAP_LOOKUP); }
+PB_BENCHMARK(hash_map_u64_iterate, 1000000) { benchmark_hash_map_u64(state, HASH_MAP_ITERATE); }
+PB_BENCHMARK(unordered_map_string_insert, 1000000) { benchmark_unordered_map_string(state, HASH_MAP_INSERT); }
+PB_BENCHMARK(unordered_map_string_lookup, 1000000) { benchmark_unordered_map_string(state, HASH_MAP_LOOKUP); }
+PB_BENCHMARK(unordered_map_string_iterate, 1000000) { benchmark_unordered_map_string(state, HASH_MAP_ITERATE); }
+PB_BENCHMARK(hash_map_string_insert, 1000000) { benchmark_hash_map_string(state, HASH_MAP_INSERT); }
+PB_BENCHMARK(hash_map_string_lookup, 1000000) { benchmark_hash_map_string(state, HASH_MAP_LOOKUP); }
+PB_BENCHMARK(hash_map_string_iterate, 1000000) { benchmark_hash_map_string(state, HASH_MAP_ITERATE); }
+
+// Cost of an instrumented scope, the profiler needs working perf counters
+PB_BENCHMARK(profile_scope, 1000000) {
+  if (!pb_profiler::pb_perf_event_try_open(pb_profiler::PB_PERF_CYCLES)) {
+    state.skip("perf counters not available");
+    return;
+  }
+  char log_name[64];
+  {
+    pb_profiler::PbProfilerStart profiler("benchmark.log");
+    state.start();
+    for (u64 i = 0; i < state.iterations; i++) {
+      PbProfileFunctionF(f, "benchmark_scope", pb_profiler::PB_PROFILE_CACHE | pb_profiler::PB_PROFILE_BRANCH);
+    }
+    state.stop();
+  }
+  snprintf(log_name, sizeof(log_name), "%d-benchmark.log", getpid());
+  unlink(log_name);
+}
+
+PB_BENCHMARK_MAIN()
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <x86intrin.h>
+#include "time_function.h"
+
+// Microbenchmark harness on top of the profiler perf counters.
+//
+// PB_BENCHMARK(name, iterations) {
+//     ... setup ...
+//     state.start();
+//     for (uint64_t i = 0; i < state.iterations; i++) { ... pb_benchmark::no_optimize(x); }
+//     state.stop();
+// }
+// PB_BENCHMARK_MAIN()
+//
+// Without start/stop the whole body is measured. Every benchmark runs warmup
+// times untimed and then repetitions times, metrics are reported per
+// iteration as median and median absolute deviation over the repetitions.
+namespace pb_benchmark {
+    using namespace pb_profiler;
+
+    enum pb_benchmark_metric {
+        PB_BENCHMARK_TSC = 0,
+        PB_BENCHMARK_CYCLES = 1,
+        PB_BENCHMARK_INSTRUCTIONS = 2,
+        PB_BENCHMARK_CACHE_MISSES = 3,
+        PB_BENCHMARK_BRANCH_MISSES = 4,
+        PB_BENCHMARK_METRIC_LAST = 5,
+    };
+
+    static const char* pb_benchmark_metric_names[PB_BENCHMARK_METRIC_LAST] = {
+        "tsc", "cycles", "instructions", "cache_misses", "branch_misses",
+    };
+    // Metric index to perf event, tsc is read with rdtsc
+    static const pb_perf_event_type pb_benchmark_metric_events[PB_BENCHMARK_METRIC_LAST] = {
+        PB_PERF_CYCLES, PB_PERF_CYCLES, PB_PERF_INSTRUCTIONS, PB_PERF_CACHE_MISSES, PB_PERF_BRANCH_MISS,
+    };
+
+    template <typename T>
+    inline void no_optimize(T const& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    inline void clobber() {
+        asm volatile("" : : : "memory");
+    }
+
+    struct State {
+        const char* name;
+        uint64_t iterations;
+        bool available[PB_BENCHMARK_METRIC_LAST];
+        uint64_t start_values[PB_BENCHMARK_METRIC_LAST];
+        uint64_t values[PB_BENCHMARK_METRIC_LAST];
+        bool running;
+        bool stopped;
+        const char* skip_reason;
+        // Payload of the measured region, adds a bytes per cycle column when set
+        uint64_t bytes;
+
+        inline void read(uint64_t* out) {
+            for (int i = PB_BENCHMARK_METRIC_LAST - 1; i > 0; i--) {
+                out[i] = available[i] ? pb_perf_event_read(pb_benchmark_metric_events[i]) : 0;
+            }
+            out[PB_BENCHMARK_TSC] = __rdtsc();
+        }
+
+        // Restarts the measurement, call it after setup
+        inline void start() {
+            running = true;
+            stopped = false;
+            clobber();
+            read(start_values);
+        }
+
+        inline void stop() {
+            uint64_t end_values[PB_BENCHMARK_METRIC_LAST];
+            read(end_values);
+            clobber();
+            if (!running) {
+                return;
+            }
+            for (int i = 0; i < PB_BENCHMARK_METRIC_LAST; i++) {
+                values[i] = end_values[i] - start_values[i];
+            }
+            running = false;
+            stopped = true;
+        }
+
+        inline void skip(const char* reason) {
+            skip_reason = reason;
+        }
+
+        inline void set_bytes(uint64_t count) {
+            bytes = count;
+        }
+    };
+
+    typedef void (*pb_benchmark_function)(State& state);
+
+    struct pb_benchmark_entry {
+        const char* name;
+        pb_benchmark_function function;
+        uint64_t iterations;
+    };
+
+    static inline std::vector<pb_benchmark_entry>& pb_benchmark_registry() {
+        static std::vector<pb_benchmark_entry> registry;
+        return registry;
+    }
+
+    struct Registration {
+        Registration(const char* name, pb_benchmark_function function, uint64_t iterations) {
+            pb_benchmark_registry().push_back({name, function, iterations});
+        }
+    };
+
+    struct pb_benchmark_summary {
+        double median;
+        double mad;
+    };
+
+    static inline double pb_benchmark_median(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        uint64_t n = values.size();
+        if (n % 2 == 1) {
+            return values[n / 2];
+        }
+        return (values[n / 2 - 1] + values[n / 2]) / 2.0;
+    }
+
+    static inline pb_benchmark_summary pb_benchmark_summarize(const std::vector<double>& values) {
+        pb_benchmark_summary summary;
+        summary.median = pb_benchmark_median(values);
+        std::vector<double> deviations;
+        for (double value : values) {
+            deviations.push_back(value > summary.median ? value - summary.median : summary.median - value);
+        }
+        summary.mad = pb_benchmark_median(deviations);
+        return summary;
+    }
+
+    struct pb_benchmark_options {
+        const char* filter = NULL;
+        const char* json_path = NULL;
+        uint64_t repetitions = 5;
+        uint64_t warmup = 1;
+    };
+
+    static inline bool pb_benchmark_parse_options(int argc, char** argv, pb_benchmark_options& options) {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+                options.filter = argv[++i];
+            } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+                options.json_path = argv[++i];
+            } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+                options.repetitions = strtoull(argv[++i], NULL, 10);
+            } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+                options.warmup = strtoull(argv[++i], NULL, 10);
+            } else {
+                printf("Usage: %s [--filter substring] [--repetitions n] [--warmup n] [--json file]\n", argv[0]);
+                return false;
+            }
+        }
+        if (options.repetitions == 0) {
+            options.repetitions = 1;
+        }
+        return true;
+    }
+
+    static inline void pb_benchmark_run_once(pb_benchmark_entry& entry, State& state) {
+        state.name = entry.name;
+        state.iterations = entry.iterations;
+        state.running = false;
+        state.stopped = false;
+        state.skip_reason = NULL;
+        state.bytes = 0;
+        memset(state.values, 0, sizeof(state.values));
+        state.start();
+        entry.function(state);
+        if (!state.stopped) {
+            state.stop();
+        }
+    }
+
+    static inline int pb_benchmark_run_all(int argc, char** argv) {
+        pb_benchmark_options options;
+        if (!pb_benchmark_parse_options(argc, argv, options)) {
+            return 1;
+        }
+        State state;
+        state.available[PB_BENCHMARK_TSC] = true;
+        bool any_counter = false;
+        for (int i = 1; i < PB_BENCHMARK_METRIC_LAST; i++) {
+            state.available[i] = pb_perf_event_try_open(pb_benchmark_metric_events[i]);
+            any_counter |= state.available[i];
+        }
+        if (!any_counter) {
+            printf("perf counters not available, reporting tsc only\n");
+        }
+
+        FILE* json = NULL;
+        if (options.json_path != NULL) {
+            json = fopen(options.json_path, "w");
+            if (json == NULL) {
+                printf("Error: fopen() failed json file %s\n", options.json_path);
+                return 1;
+            }
+            fprintf(json, "{\n  \"repetitions\": %lu,\n  \"benchmarks\": [", options.repetitions);
+        }
+
+        printf("%-36s %12s", "benchmark", "iterations");
+        for (int i = 0; i < PB_BENCHMARK_METRIC_LAST; i++) {
+            if (state.available[i]) {
+                printf(" %22s", pb_benchmark_metric_names[i]);
+            }
+        }
+        printf("\n");
+
+        bool first_json = true;
+        for (pb_benchmark_entry& entry : pb_benchmark_registry()) {
+            if (options.filter != NULL && strstr(entry.name, options.filter) == NULL) {
+                continue;
+            }
+            for (uint64_t i = 0; i < options.warmup; i++) {
+                pb_benchmark_run_once(entry, state);
+            }
+            std::vector<double> per_iteration[PB_BENCHMARK_METRIC_LAST];
+            // Cycles when perf has them, tsc otherwise
+            int clock = state.available[PB_BENCHMARK_CYCLES] ? PB_BENCHMARK_CYCLES : PB_BENCHMARK_TSC;
+            std::vector<double> bytes_per_cycle;
+            for (uint64_t i = 0; i < options.repetitions && state.skip_reason == NULL; i++) {
+                pb_benchmark_run_once(entry, state);
+                for (int metric = 0; metric < PB_BENCHMARK_METRIC_LAST; metric++) {
+                    per_iteration[metric].push_back((double)state.values[metric] / (double)entry.iterations);
+                }
+                if (state.bytes > 0 && state.values[clock] > 0) {
+                    bytes_per_cycle.push_back((double)state.bytes / (double)state.values[clock]);
+                }
+            }
+            if (state.skip_reason != NULL) {
+                printf("%-36s skipped: %s\n", entry.name, state.skip_reason);
+                continue;
+            }
+
+            printf("%-36s %12lu", entry.name, entry.iterations);
+            if (json != NULL) {
+                fprintf(json, "%s\n    {\"name\": \"%s\", \"iterations\": %lu, \"metrics\": {", first_json ? "" : ",", entry.name, entry.iterations);
+            }
+            bool first_metric = true;
+            for (int metric = 0; metric < PB_BENCHMARK_METRIC_LAST; metric++) {
+                if (!state.available[metric]) {
+                    continue;
+                }
+                pb_benchmark_summary summary = pb_benchmark_summarize(per_iteration[metric]);
+                printf(" %12.2f +-%7.2f", summary.median, summary.mad);
+                if (json != NULL) {
+                    fprintf(json, "%s\"%s\": {\"median\": %f, \"mad\": %f}", first_metric ? "" : ", ",
+                            pb_benchmark_metric_names[metric], summary.median, summary.mad);
+                }
+                first_metric = false;
+            }
+            if (!bytes_per_cycle.empty()) {
+                const char* unit = clock == PB_BENCHMARK_CYCLES ? "bytes/cycle" : "bytes/tsc";
+                pb_benchmark_summary summary = pb_benchmark_summarize(bytes_per_cycle);
+                printf(" %12.2f +-%7.2f %s", summary.median, summary.mad, unit);
+                if (json != NULL) {
+                    fprintf(json, "%s\"%s\": {\"median\": %f, \"mad\": %f}", first_metric ? "" : ", ",
+                            clock == PB_BENCHMARK_CYCLES ? "bytes_per_cycle" : "bytes_per_tsc", summary.median, summary.mad);
+                }
+            }
+            printf("\n");
+            if (json != NULL) {
+                fprintf(json, "}}");
+            }
+            first_json = false;
+        }
+        if (json != NULL) {
+            fprintf(json, "\n  ]\n}\n");
+            fclose(json);
+        }
+        return 0;
+    }
+}
+
+#define PB_BENCHMARK(name, iterations) \
+    static void pb_benchmark_##name(pb_benchmark::State& state); \
+    static pb_benchmark::Registration pb_benchmark_registration_##name(#name, pb_benchmark_##name, iterations); \
+    static void pb_benchmark_##name(pb_benchmark::State& state)
+
+#define PB_BENCHMARK_MAIN() \
+    int main(int argc, char** argv) { return pb_benchmark::pb_benchmark_run_all(argc, argv); }
@@ -1,5 +1,9 @@
 #!/bin/bash
 #
 gcc -ggdb -O -o test test.c profiler.cc
+g++ -ggdb -O2 -rdynamic -o test_new_delete test_new_delete.cc
+g++ -ggdb -O2 -no-pie -o test_profile_here test_profile_here.cc profiler.cc
 g++ -ggdb -O2 -o test_time time_function_example.cc profiler.cc
 g++ -ggdb -O2 -o stats time_function_stats.cc profiler.cc
+g++ -ggdb -O2 -o benchmark benchmark.cc profiler.cc
+g++ -ggdb -O2 -c -o time_function_instrument.o time_function_instrument.cc
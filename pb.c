@@ -10,14 +10,80 @@ Arena pb_arena_allocate(u64 capacity) {
         Arena arena;
         arena.memory = memory;
         arena.capacity = capacity;
+        arena.committed = capacity;
+        arena.commit_size = 0;
+        arena.decommit_threshold = capacity;
         arena.pos = 0;
+        arena.dirty_end = 0;
         arena.auto_align = 0;
         return arena;
 }
 
+Arena pb_arena_reserve(u64 capacity, u64 commit_size) {
+        pb_assert(commit_size > 0 && (commit_size & (commit_size - 1)) == 0);
+        capacity = pb_align_up(capacity, commit_size);
+        void* memory = mmap(0, capacity, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+                printf("Failed to reserve memory\n");
+                abort();
+        }
+        Arena arena;
+        arena.memory = memory;
+        arena.capacity = capacity;
+        arena.committed = 0;
+        arena.commit_size = commit_size;
+        arena.decommit_threshold = PB_ARENA_DECOMMIT_THRESHOLD;
+        arena.pos = 0;
+        arena.dirty_end = 0;
+        arena.auto_align = 0;
+        return arena;
+}
+
+void pb_arena_commit(Arena* arena, u64 end) {
+        pb_assert(end <= arena->capacity);
+        if (end <= arena->committed) {
+                return;
+        }
+        u64 new_committed = pb_align_up(end, arena->commit_size);
+        if (new_committed > arena->capacity) {
+                new_committed = arena->capacity;
+        }
+        int ret = mprotect((u8*)arena->memory + arena->committed, new_committed - arena->committed, PROT_READ | PROT_WRITE);
+        pb_assert(ret == 0);
+        arena->committed = new_committed;
+}
+
+// Give back committed pages above max(pos, decommit_threshold)
+void pb_arena_decommit(Arena* arena, u64 pos) {
+        if (arena->commit_size == 0) {
+                return;
+        }
+        u64 keep = pb_align_up(pos, arena->commit_size);
+        if (keep < arena->decommit_threshold) {
+                keep = pb_align_up(arena->decommit_threshold, arena->commit_size);
+        }
+        if (keep >= arena->committed) {
+                return;
+        }
+        u8* start = (u8*)arena->memory + keep;
+        madvise(start, arena->committed - keep, MADV_DONTNEED);
+        int ret = mprotect(start, arena->committed - keep, PROT_NONE);
+        pb_assert(ret == 0);
+        arena->committed = keep;
+        if (arena->dirty_end > keep) {
+                arena->dirty_end = keep;
+        }
+}
+
 void pb_arena_release(Allocator* allocator) {
         Arena* arena = pb_allocator_arena_get(allocator);
-        munmap(arena, arena->capacity + sizeof(Arena));
+        munmap(arena->memory, arena->capacity);
+        arena->memory = NULL;
+        arena->capacity = 0;
+        arena->committed = 0;
+        arena->pos = 0;
+        arena->dirty_end = 0;
 }
 void pb_arena_set_auto_align(Allocator* allocator, u64 align) {
         Arena* arena = pb_allocator_arena_get(allocator);
@@ -31,96 +97,1490 @@ u64 pb_arena_pos(Allocator* allocator) {
 }
 
 void* pb_arena_push_no_zero(Allocator* allocator, u64 size) {
-        Arena* arena = pb_allocator_arena_get(allocator);
-        u64 align = arena->auto_align;
-        if (align > 0) {
-                u64 left = pb_align((u64)arena->memory + arena->pos, align);
-                pb_debug(left);
-                arena->pos += left;
-        }
-
-        void* result = arena->memory + arena->pos;
-        arena->pos += size;
-        return result;
+        return pb_arena_bump(pb_allocator_arena_get(allocator), size);
 }
 
 void* pb_arena_push_aligner(Allocator* allocator, u64 align) {
-        // ?
-}
-
-void* pb_arena_push(Allocator* allocator, u64 size) {
         Arena* arena = pb_allocator_arena_get(allocator);
-        u64 align = arena->auto_align;
-        if (align > 0) {
-                u64 left = pb_align((u64)arena->memory + arena->pos, align);
-                pb_debug(left);
-                arena->pos += left;
+        pb_assert((align & (align - 1)) == 0);
+        u64 left = pb_align((u64)arena->memory + arena->pos, align);
+        u64 end = arena->pos + left;
+        if (end > arena->committed) {
+                pb_arena_commit(arena, end);
         }
+        arena->pos = end;
+        return (u8*)arena->memory + arena->pos;
+}
 
-        void* result = arena->memory + arena->pos;
-        pb_assert(arena->pos + size < arena->capacity);
-        arena->pos += size;
-        pb_memset(result, 0, size);
-        return result;
+void* pb_arena_push(Allocator* allocator, u64 size) {
+        return pb_arena_bump_zero(pb_allocator_arena_get(allocator), size);
 }
 
 void pb_arena_pop_to(Allocator* allocator, u64 pos) { 
         Arena* arena = pb_allocator_arena_get(allocator);
+        pb_assert(pos <= arena->pos);
         arena->pos = pos; 
+        pb_arena_decommit(arena, pos);
 }
 
 void pb_arena_deallocate(Allocator* allocator, void* memory_to) { 
 }
 
+void* pb_arena_reallocate(Allocator* allocator, void* memory, u64 old_size, u64 new_size) {
+        Arena* arena = pb_allocator_arena_get(allocator);
+        if (memory != NULL && (u8*)memory + old_size == (u8*)arena->memory + arena->pos) {
+                // Last allocation, move pos instead of copying
+                u64 end = ((u8*)memory - (u8*)arena->memory) + new_size;
+                if (end > arena->committed) {
+                        pb_arena_commit(arena, end);
+                }
+                if (end > arena->dirty_end) {
+                        arena->dirty_end = end;
+                }
+                arena->pos = end;
+                return memory;
+        }
+        if (memory != NULL && new_size <= old_size) {
+                return memory;
+        }
+        void* result = pb_arena_bump(arena, new_size);
+        if (memory != NULL) {
+                pb_memcpy(result, memory, old_size);
+        }
+        return result;
+}
+
 void pb_arena_pop(Allocator* allocator, void* memory_to) { 
         Arena* arena = pb_allocator_arena_get(allocator);
-        u64 size = (u64)memory_to - pb_arena_pos(allocator);
-        arena->pos -= size; 
+        pb_arena_pop_to(allocator, (u64)memory_to - (u64)arena->memory);
 }
 
 void pb_arena_clear(Allocator* allocator) { 
-        Arena* arena = pb_allocator_arena_get(allocator);
-        arena->pos = 0; 
+        pb_arena_pop_to(allocator, 0);
+}
+
+ArenaTemp pb_arena_temp_begin(Allocator* allocator) {
+        ArenaTemp temp;
+        temp.allocator = allocator;
+        temp.pos = pb_arena_pos(allocator);
+        return temp;
+}
+
+void pb_arena_temp_end(ArenaTemp temp) {
+        pb_arena_pop_to(temp.allocator, temp.pos);
 }
 
 inline u64 pb_align(u64 value, u64 align) {
         return (align - ((align - 1) & value)) & (align - 1);
 }
 
-inline void pb_memset(void* memory, u8 value, u64 size) {
+inline u64 pb_align_up(u64 value, u64 align) {
+        return value + pb_align(value, align);
+}
+
+void pb_memset_bytes(void* memory, u8 value, u64 size) {
         u8* p = (u8*)memory;
         for (u64 i = 0; i < size; i++) {
                 p[i] = value;
         }
 }
 
+// Sizes below the vector width, overlapping stores instead of a byte loop
+static inline void pb_memset_small(u8* p, u8 value, u64 size) {
+        u64 v = 0x0101010101010101ULL * value;
+        if (size >= 8) {
+                memcpy(p, &v, 8);
+                memcpy(p + size - 8, &v, 8);
+        } else if (size >= 4) {
+                memcpy(p, &v, 4);
+                memcpy(p + size - 4, &v, 4);
+        } else {
+                for (u64 i = 0; i < size; i++) {
+                        p[i] = value;
+                }
+        }
+}
+
+static inline void pb_memcpy_small(u8* d, const u8* s, u64 size) {
+        if (size >= 8) {
+                u64 head, tail;
+                memcpy(&head, s, 8);
+                memcpy(&tail, s + size - 8, 8);
+                memcpy(d, &head, 8);
+                memcpy(d + size - 8, &tail, 8);
+        } else if (size >= 4) {
+                u32 head, tail;
+                memcpy(&head, s, 4);
+                memcpy(&tail, s + size - 4, 4);
+                memcpy(d, &head, 4);
+                memcpy(d + size - 4, &tail, 4);
+        } else {
+                for (u64 i = 0; i < size; i++) {
+                        d[i] = s[i];
+                }
+        }
+}
+
+// Unaligned head and tail stores overlap the aligned body so there is no scalar remainder
+void pb_memset_sse2(void* memory, u8 value, u64 size) {
+        u8* p = (u8*)memory;
+        if (size < 16) {
+                pb_memset_small(p, value, size);
+                return;
+        }
+        __m128i v = _mm_set1_epi8((char)value);
+        u8* end = p + size;
+        _mm_storeu_si128((__m128i*)p, v);
+        u8* q = p + pb_align((u64)p, 16);
+        for (; q + 64 <= end; q += 64) {
+                _mm_store_si128((__m128i*)q, v);
+                _mm_store_si128((__m128i*)(q + 16), v);
+                _mm_store_si128((__m128i*)(q + 32), v);
+                _mm_store_si128((__m128i*)(q + 48), v);
+        }
+        for (; q + 16 <= end; q += 16) {
+                _mm_store_si128((__m128i*)q, v);
+        }
+        _mm_storeu_si128((__m128i*)(end - 16), v);
+}
+
+__attribute__((target("avx2")))
+void pb_memset_avx2(void* memory, u8 value, u64 size) {
+        u8* p = (u8*)memory;
+        if (size < 32) {
+                if (size >= 16) {
+                        __m128i v = _mm_set1_epi8((char)value);
+                        _mm_storeu_si128((__m128i*)p, v);
+                        _mm_storeu_si128((__m128i*)(p + size - 16), v);
+                        return;
+                }
+                pb_memset_small(p, value, size);
+                return;
+        }
+        __m256i v = _mm256_set1_epi8((char)value);
+        u8* end = p + size;
+        _mm256_storeu_si256((__m256i*)p, v);
+        u8* q = p + pb_align((u64)p, 32);
+        for (; q + 128 <= end; q += 128) {
+                _mm256_store_si256((__m256i*)q, v);
+                _mm256_store_si256((__m256i*)(q + 32), v);
+                _mm256_store_si256((__m256i*)(q + 64), v);
+                _mm256_store_si256((__m256i*)(q + 96), v);
+        }
+        for (; q + 32 <= end; q += 32) {
+                _mm256_store_si256((__m256i*)q, v);
+        }
+        _mm256_storeu_si256((__m256i*)(end - 32), v);
+        _mm256_zeroupper();
+}
+
+void pb_memcpy_sse2(void* destination, const void* source, u64 size) {
+        u8* d = (u8*)destination;
+        const u8* s = (const u8*)source;
+        if (size < 16) {
+                pb_memcpy_small(d, s, size);
+                return;
+        }
+        // Tail is loaded up front, the body may overwrite it when the ranges touch
+        __m128i tail = _mm_loadu_si128((const __m128i*)(s + size - 16));
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+        u64 i = pb_align((u64)d, 16);
+        for (; i + 64 <= size; i += 64) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 16));
+                __m128i c = _mm_loadu_si128((const __m128i*)(s + i + 32));
+                __m128i e = _mm_loadu_si128((const __m128i*)(s + i + 48));
+                _mm_store_si128((__m128i*)(d + i), a);
+                _mm_store_si128((__m128i*)(d + i + 16), b);
+                _mm_store_si128((__m128i*)(d + i + 32), c);
+                _mm_store_si128((__m128i*)(d + i + 48), e);
+        }
+        for (; i + 16 <= size; i += 16) {
+                _mm_store_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(s + i)));
+        }
+        _mm_storeu_si128((__m128i*)(d + size - 16), tail);
+}
+
+__attribute__((target("avx2")))
+void pb_memcpy_avx2(void* destination, const void* source, u64 size) {
+        u8* d = (u8*)destination;
+        const u8* s = (const u8*)source;
+        if (size < 32) {
+                pb_memcpy_sse2(d, s, size);
+                return;
+        }
+        __m256i tail = _mm256_loadu_si256((const __m256i*)(s + size - 32));
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+        u64 i = pb_align((u64)d, 32);
+        for (; i + 128 <= size; i += 128) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+                __m256i b = _mm256_loadu_si256((const __m256i*)(s + i + 32));
+                __m256i c = _mm256_loadu_si256((const __m256i*)(s + i + 64));
+                __m256i e = _mm256_loadu_si256((const __m256i*)(s + i + 96));
+                _mm256_store_si256((__m256i*)(d + i), a);
+                _mm256_store_si256((__m256i*)(d + i + 32), b);
+                _mm256_store_si256((__m256i*)(d + i + 64), c);
+                _mm256_store_si256((__m256i*)(d + i + 96), e);
+        }
+        for (; i + 32 <= size; i += 32) {
+                _mm256_store_si256((__m256i*)(d + i), _mm256_loadu_si256((const __m256i*)(s + i)));
+        }
+        _mm256_storeu_si256((__m256i*)(d + size - 32), tail);
+        _mm256_zeroupper();
+}
+
+// glibc already picks erms/avx2/evex variants through ifunc, in ./benchmark --filter mem
+// a 64B memset ran at 27 bytes/tsc against 21 for sse2 and 13 for avx2, so the entry
+// points go to libc.
+inline void pb_memset(void* memory, u8 value, u64 size) {
+        memset(memory, value, size);
+}
+
+inline void pb_memcpy(void* destination, const void* source, u64 size) {
+        memcpy(destination, source, size);
+}
+
 inline u64 pb_cycles() { return __rdtsc(); }
 
+static inline SystemAllocationHeader* pb_sys_header(void* memory) {
+        return (SystemAllocationHeader*)memory - 1;
+}
+
 void* pb_sys_allocate(Allocator* alloc, u64 size) {
-        // TODO(Pere): Add alignment
-        return malloc(size);
+        SystemAllocator* sys_alloc = pb_get_allocator_system_get(alloc);
+        u64 align = sys_alloc->alignment > sizeof(SystemAllocationHeader) ? sys_alloc->alignment : sizeof(SystemAllocationHeader);
+        u8* memory;
+        SystemAllocationHeader header;
+        if (size + align >= PB_SYS_MAP_THRESHOLD || sys_alloc->numa.mode != PB_NUMA_DEFAULT) {
+                pb_assert(align <= 4096);
+                header.mapped_size = pb_align_up(size + align, 4096);
+                header.offset = align;
+                u8* base = (u8*)mmap(0, header.mapped_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (base == MAP_FAILED) {
+                        return NULL;
+                }
+                pb_numa_apply(base, header.mapped_size, sys_alloc->numa);
+                memory = base + align;
+        } else {
+                // malloc is 16 byte aligned, align bytes cover the header and the padding
+                u8* base = (u8*)malloc(size + align);
+                if (base == NULL) {
+                        return NULL;
+                }
+                memory = base + sizeof(SystemAllocationHeader);
+                memory += pb_align((u64)memory, align);
+                header.mapped_size = 0;
+                header.offset = memory - base;
+        }
+        *pb_sys_header(memory) = header;
+        return memory;
 }
 void pb_sys_deallocate(Allocator* alloc, void* memory) {
-        free(memory);
+        if (memory == NULL) {
+                return;
+        }
+        SystemAllocationHeader* header = pb_sys_header(memory);
+        u8* base = (u8*)memory - header->offset;
+        if (header->mapped_size > 0) {
+                munmap(base, header->mapped_size);
+        } else {
+                free(base);
+        }
+}
+void* pb_sys_reallocate(Allocator* alloc, void* memory, u64 old_size, u64 new_size) {
+        if (memory == NULL) {
+                return pb_sys_allocate(alloc, new_size);
+        }
+        SystemAllocationHeader* header = pb_sys_header(memory);
+        if (header->mapped_size > 0 && new_size + header->offset >= PB_SYS_MAP_THRESHOLD) {
+                // Let the kernel move the page tables instead of copying
+                u64 offset = header->offset;
+                u64 mapped_size = pb_align_up(new_size + offset, 4096);
+                u8* base = (u8*)mremap((u8*)memory - offset, header->mapped_size, mapped_size, MREMAP_MAYMOVE);
+                if (base == MAP_FAILED) {
+                        return NULL;
+                }
+                memory = base + offset;
+                pb_sys_header(memory)->mapped_size = mapped_size;
+                return memory;
+        }
+        return pb_allocator_reallocate_copy(alloc, memory, old_size, new_size);
 }
 void pb_sys_set_auto_align(Allocator* alloc, u64 size) {
         SystemAllocator* sys_alloc = pb_get_allocator_system_get(alloc);
+        pb_assert((size & (size - 1)) == 0);
         sys_alloc->alignment = size;
 }
 
+void* pb_allocator_reallocate_copy(Allocator* allocator, void* memory, u64 old_size, u64 new_size) {
+        void* result = allocator->allocate(allocator, new_size);
+        if (memory != NULL) {
+                pb_memcpy(result, memory, old_size < new_size ? old_size : new_size);
+                allocator->deallocate(allocator, memory);
+        }
+        return result;
+}
+
+static __thread PoolThreadCache pb_pool_thread_caches[PB_POOL_MAX_POOLS];
+static u64 pb_pool_next_id = 0;
+static pthread_mutex_t pb_pool_live_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Pool* pb_pool_live = NULL;
+static pthread_key_t pb_pool_thread_key;
+static pthread_once_t pb_pool_thread_key_once = PTHREAD_ONCE_INIT;
+
+// mmap with size aligned start, needed to find slab headers by masking
+static void* pb_pool_map_aligned(u64 size, u64 align) {
+        u8* memory = (u8*)mmap(0, size + align, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+                printf("Failed to allocate pool memory\n");
+                abort();
+        }
+        u64 head = pb_align((u64)memory, align);
+        if (head > 0) {
+                munmap(memory, head);
+        }
+        munmap(memory + head + size, align - head);
+        return memory + head;
+}
+
+static void pb_pool_depot_put_batch(PoolDepot* depot, PoolFreeNode* batch) {
+        pthread_mutex_lock(&depot->mutex);
+        batch->next_batch = depot->batches;
+        depot->batches = batch;
+        pthread_mutex_unlock(&depot->mutex);
+}
+
+static void pb_pool_depot_put_list(PoolDepot* depot, PoolFreeNode* head) {
+        while (head != NULL) {
+                PoolFreeNode* batch = head;
+                PoolFreeNode* last = head;
+                for (u64 n = 1; n < PB_POOL_BATCH && last->next != NULL; n++) {
+                        last = last->next;
+                }
+                head = last->next;
+                last->next = NULL;
+                pb_pool_depot_put_batch(depot, batch);
+        }
+}
+
+// Returns the cached objects and the unused bump ranges to the depots in batches
+// of at most PB_POOL_BATCH and empties the cache
+static void pb_pool_cache_drain(PoolThreadCache* cache) {
+        if (cache->pool == NULL) {
+                return;
+        }
+        pthread_mutex_lock(&pb_pool_live_mutex);
+        Pool* pool = pb_pool_live;
+        while (pool != NULL && (pool != cache->pool || pool->id != cache->pool_id)) {
+                pool = pool->next_live;
+        }
+        // Holding the live list keeps the pool from being released meanwhile
+        for (u64 i = 0; pool != NULL && i < PB_POOL_CLASS_COUNT; i++) {
+                u64 class_size = 1ULL << (i + PB_POOL_MIN_CLASS_SHIFT);
+                PoolFreeNode* bump = NULL;
+                for (u8* p = cache->bump_pos[i]; p != NULL && p + class_size <= cache->bump_end[i]; p += class_size) {
+                        PoolFreeNode* node = (PoolFreeNode*)p;
+                        node->next = bump;
+                        bump = node;
+                }
+                // Freed objects go in last so they are the first handed out again
+                pb_pool_depot_put_list(&pool->depots[i], bump);
+                pb_pool_depot_put_list(&pool->depots[i], cache->heads[i]);
+        }
+        pthread_mutex_unlock(&pb_pool_live_mutex);
+        memset(cache, 0, sizeof(PoolThreadCache));
+}
+
+static void pb_pool_thread_exit(void* value) {
+        for (u64 i = 0; i < PB_POOL_MAX_POOLS; i++) {
+                if (pb_pool_thread_caches[i].pool != NULL) {
+                        pb_pool_cache_drain(&pb_pool_thread_caches[i]);
+                }
+        }
+}
+
+static void pb_pool_thread_key_create() {
+        pthread_key_create(&pb_pool_thread_key, pb_pool_thread_exit);
+}
+
+Pool* pb_pool_create() {
+        Pool* pool = (Pool*)pb_pool_map_aligned(pb_align_up(sizeof(Pool), 4096), 64);
+        pool->id = __atomic_fetch_add(&pb_pool_next_id, 1, __ATOMIC_RELAXED);
+        pool->alignment = 16;
+        pool->numa.mode = PB_NUMA_DEFAULT;
+        pool->numa.node = 0;
+        pthread_once(&pb_pool_thread_key_once, pb_pool_thread_key_create);
+        pthread_mutex_lock(&pb_pool_live_mutex);
+        pool->next_live = pb_pool_live;
+        pb_pool_live = pool;
+        pthread_mutex_unlock(&pb_pool_live_mutex);
+        for (u64 i = 0; i < PB_POOL_CLASS_COUNT; i++) {
+                PoolDepot* depot = &pool->depots[i];
+                pthread_mutex_init(&depot->mutex, NULL);
+                depot->batches = NULL;
+                depot->slab_pos = NULL;
+                depot->slab_end = NULL;
+                depot->slabs = NULL;
+        }
+        return pool;
+}
+
+// Slots are shared by pools with the same id % PB_POOL_MAX_POOLS, a cache that
+// is evicted or whose thread exits gives its objects back to the pool, unless
+// the pool was released and its memory is gone
+static inline PoolThreadCache* pb_pool_thread_cache(Pool* pool) {
+        PoolThreadCache* cache = &pb_pool_thread_caches[pool->id % PB_POOL_MAX_POOLS];
+        if (__builtin_expect(cache->pool != pool || cache->pool_id != pool->id, 0)) {
+                pb_pool_cache_drain(cache);
+                cache->pool = pool;
+                cache->pool_id = pool->id;
+                pthread_setspecific(pb_pool_thread_key, cache);
+        }
+        return cache;
+}
+
+static inline u64 pb_pool_class_index(u64 size) {
+        if (size <= (1ULL << PB_POOL_MIN_CLASS_SHIFT)) {
+                return 0;
+        }
+        return 64 - __builtin_clzll(size - 1) - PB_POOL_MIN_CLASS_SHIFT;
+}
+
+// Refills the thread cache with a batch of freed objects, or a fresh slab range if there is none
+static void pb_pool_depot_refill(PoolDepot* depot, PoolThreadCache* cache, u64 class_index) {
+        u64 class_size = 1ULL << (class_index + PB_POOL_MIN_CLASS_SHIFT);
+        pthread_mutex_lock(&depot->mutex);
+        PoolFreeNode* batch = depot->batches;
+        if (batch != NULL) {
+                depot->batches = batch->next_batch;
+                pthread_mutex_unlock(&depot->mutex);
+                // Drained caches park batches shorter than PB_POOL_BATCH
+                u32 count = 1;
+                for (PoolFreeNode* node = batch->next; node != NULL; node = node->next) {
+                        count++;
+                }
+                cache->heads[class_index] = batch;
+                cache->counts[class_index] = count;
+                return;
+        }
+        if ((u64)(depot->slab_end - depot->slab_pos) < class_size) {
+                PoolSlab* slab = (PoolSlab*)pb_pool_map_aligned(PB_POOL_SLAB_SIZE, PB_POOL_SLAB_SIZE);
+                pb_numa_apply(slab, PB_POOL_SLAB_SIZE, cache->pool->numa);
+                slab->class_size = class_size;
+                slab->mapped_size = PB_POOL_SLAB_SIZE;
+                slab->next = depot->slabs;
+                depot->slabs = slab;
+                // Objects start at a multiple of class_size, which gives them class_size alignment
+                depot->slab_pos = (u8*)slab + pb_align_up(sizeof(PoolSlab), class_size);
+                depot->slab_end = (u8*)slab + PB_POOL_SLAB_SIZE;
+        }
+        u64 range = (u64)(depot->slab_end - depot->slab_pos);
+        u64 batch_range = class_size * PB_POOL_BATCH;
+        if (batch_range < 16 * 1024) {
+                batch_range = 16 * 1024;
+        }
+        if (range > batch_range) {
+                range = batch_range;
+        }
+        cache->bump_pos[class_index] = depot->slab_pos;
+        cache->bump_end[class_index] = depot->slab_pos + range;
+        depot->slab_pos += range;
+        pthread_mutex_unlock(&depot->mutex);
+}
+
+
+void* pb_pool_allocate(Allocator* allocator, u64 size) {
+        Pool* pool = allocator->ctx.pool;
+        u64 class_size = size > pool->alignment ? size : pool->alignment;
+        if (class_size > PB_POOL_MAX_CLASS_SIZE) {
+                u64 offset = pb_align_up(sizeof(PoolSlab), pool->alignment > 64 ? pool->alignment : 64);
+                u64 mapped_size = pb_align_up(offset + size, 4096);
+                PoolSlab* slab = (PoolSlab*)pb_pool_map_aligned(mapped_size, PB_POOL_SLAB_SIZE);
+                pb_numa_apply(slab, mapped_size, pool->numa);
+                slab->class_size = 0;
+                slab->mapped_size = mapped_size;
+                slab->next = NULL;
+                return (u8*)slab + offset;
+        }
+        u64 class_index = pb_pool_class_index(class_size);
+        PoolThreadCache* cache = pb_pool_thread_cache(pool);
+        PoolFreeNode* node = cache->heads[class_index];
+        if (node != NULL) {
+                cache->heads[class_index] = node->next;
+                cache->counts[class_index]--;
+                return node;
+        }
+        u64 bump_size = 1ULL << (class_index + PB_POOL_MIN_CLASS_SHIFT);
+        if (cache->bump_pos[class_index] == cache->bump_end[class_index]) {
+                pb_pool_depot_refill(&pool->depots[class_index], cache, class_index);
+                node = cache->heads[class_index];
+                if (node != NULL) {
+                        cache->heads[class_index] = node->next;
+                        cache->counts[class_index]--;
+                        return node;
+                }
+        }
+        void* result = cache->bump_pos[class_index];
+        cache->bump_pos[class_index] += bump_size;
+        return result;
+}
+
+void pb_pool_deallocate(Allocator* allocator, void* memory) {
+        if (memory == NULL) {
+                return;
+        }
+        Pool* pool = allocator->ctx.pool;
+        PoolSlab* slab = (PoolSlab*)((u64)memory & ~(u64)(PB_POOL_SLAB_SIZE - 1));
+        if (slab->class_size == 0) {
+                munmap(slab, slab->mapped_size);
+                return;
+        }
+        u64 class_index = pb_pool_class_index(slab->class_size);
+        PoolThreadCache* cache = pb_pool_thread_cache(pool);
+        PoolFreeNode* node = (PoolFreeNode*)memory;
+        node->next = cache->heads[class_index];
+        cache->heads[class_index] = node;
+        cache->counts[class_index]++;
+        if (cache->counts[class_index] >= 2 * PB_POOL_BATCH) {
+                // Hand the oldest batch back so memory freed by one thread can be reused by others
+                PoolFreeNode* last = node;
+                for (u64 i = 1; i < PB_POOL_BATCH; i++) {
+                        last = last->next;
+                }
+                PoolFreeNode* batch = last->next;
+                last->next = NULL;
+                cache->heads[class_index] = node;
+                cache->counts[class_index] = PB_POOL_BATCH;
+                pb_pool_depot_put_batch(&pool->depots[class_index], batch);
+        }
+}
+
+void pb_pool_set_auto_align(Allocator* allocator, u64 align) {
+        Pool* pool = allocator->ctx.pool;
+        pb_assert((align & (align - 1)) == 0);
+        // Large blocks start at an offset aligned to this inside their slab, equal would put
+        // them at the next slab boundary, where deallocate finds no header
+        pb_assert(align < PB_POOL_SLAB_SIZE);
+        pool->alignment = align < 16 ? 16 : align;
+}
+
+// Large allocations still alive are not tracked and stay mapped
+void pb_pool_release(Allocator* allocator) {
+        Pool* pool = allocator->ctx.pool;
+        pthread_mutex_lock(&pb_pool_live_mutex);
+        Pool** link = &pb_pool_live;
+        while (*link != pool) {
+                link = &(*link)->next_live;
+        }
+        *link = pool->next_live;
+        pthread_mutex_unlock(&pb_pool_live_mutex);
+        PoolThreadCache* cache = &pb_pool_thread_caches[pool->id % PB_POOL_MAX_POOLS];
+        if (cache->pool == pool && cache->pool_id == pool->id) {
+                memset(cache, 0, sizeof(PoolThreadCache));
+        }
+        for (u64 i = 0; i < PB_POOL_CLASS_COUNT; i++) {
+                PoolDepot* depot = &pool->depots[i];
+                PoolSlab* slab = depot->slabs;
+                while (slab != NULL) {
+                        PoolSlab* next = slab->next;
+                        munmap(slab, slab->mapped_size);
+                        slab = next;
+                }
+                pthread_mutex_destroy(&depot->mutex);
+        }
+        munmap(pool, pb_align_up(sizeof(Pool), 4096));
+        allocator->ctx.pool = NULL;
+}
+
+static __thread ConcurrentArenaChunk pb_concurrent_arena_chunks[PB_CONCURRENT_ARENA_MAX];
+static u64 pb_concurrent_arena_next_id = 0;
+
+ConcurrentArena* pb_concurrent_arena_create(u64 capacity, u64 chunk_size) {
+        pb_assert(chunk_size > 0);
+        ConcurrentArena* arena = (ConcurrentArena*)pb_pool_map_aligned(pb_align_up(sizeof(ConcurrentArena), 4096), 64);
+        // Pages are faulted in by the thread that claims them
+        void* memory = mmap(0, capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+                printf("Failed to allocate memory\n");
+                abort();
+        }
+        arena->memory = memory;
+        arena->capacity = capacity;
+        arena->id = __atomic_fetch_add(&pb_concurrent_arena_next_id, 1, __ATOMIC_RELAXED);
+        arena->chunk_size = chunk_size;
+        arena->auto_align = 8;
+        arena->epoch = 0;
+        arena->pos = 0;
+        return arena;
+}
+
+void* pb_concurrent_arena_allocate(Allocator* allocator, u64 size) {
+        ConcurrentArena* arena = allocator->ctx.concurrent_arena;
+        ConcurrentArenaChunk* chunk = &pb_concurrent_arena_chunks[arena->id % PB_CONCURRENT_ARENA_MAX];
+        u64 epoch = __atomic_load_n(&arena->epoch, __ATOMIC_ACQUIRE);
+        if (chunk->arena != arena || chunk->arena_id != arena->id || chunk->epoch != epoch) {
+                chunk->arena = arena;
+                chunk->arena_id = arena->id;
+                chunk->epoch = epoch;
+                chunk->pos = NULL;
+                chunk->end = NULL;
+        }
+        u8* result = chunk->pos + pb_align((u64)chunk->pos, arena->auto_align);
+        if (chunk->pos == NULL || result + size > chunk->end) {
+                u64 claim = size + arena->auto_align > arena->chunk_size ? size + arena->auto_align : arena->chunk_size;
+                u64 start = __atomic_fetch_add(&arena->pos, claim, __ATOMIC_RELAXED);
+                pb_assert(start + claim <= arena->capacity);
+                chunk->pos = (u8*)arena->memory + start;
+                chunk->end = chunk->pos + claim;
+                result = chunk->pos + pb_align((u64)chunk->pos, arena->auto_align);
+        }
+        chunk->pos = result + size;
+        return result;
+}
+
+void pb_concurrent_arena_deallocate(Allocator* allocator, void* memory) {
+}
+
+void pb_concurrent_arena_set_auto_align(Allocator* allocator, u64 align) {
+        ConcurrentArena* arena = allocator->ctx.concurrent_arena;
+        pb_assert(align > 0 && (align & (align - 1)) == 0);
+        arena->auto_align = align;
+}
+
+void pb_concurrent_arena_reset(Allocator* allocator) {
+        ConcurrentArena* arena = allocator->ctx.concurrent_arena;
+        __atomic_store_n(&arena->pos, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&arena->epoch, 1, __ATOMIC_RELEASE);
+}
+
+void pb_concurrent_arena_release(Allocator* allocator) {
+        ConcurrentArena* arena = allocator->ctx.concurrent_arena;
+        munmap(arena->memory, arena->capacity);
+        munmap(arena, pb_align_up(sizeof(ConcurrentArena), 4096));
+        allocator->ctx.concurrent_arena = NULL;
+}
+
+// mbind modes and get_mempolicy flags from linux/mempolicy.h, libnuma isn't needed for these
+#define PB_MPOL_PREFERRED 1
+#define PB_MPOL_BIND 2
+#define PB_MPOL_INTERLEAVE 3
+#define PB_MPOL_F_NODE 1
+#define PB_MPOL_F_ADDR 2
+
+static u32 pb_numa_nodes = 0;
+
+u32 pb_numa_node_count() {
+        u32 count = __atomic_load_n(&pb_numa_nodes, __ATOMIC_RELAXED);
+        if (count != 0) {
+                return count;
+        }
+        // "0", "0-1" or "0,2-3", the last number is the highest node
+        count = 1;
+        FILE* file = fopen("/sys/devices/system/node/online", "r");
+        if (file != NULL) {
+                char line[256];
+                if (fgets(line, sizeof(line), file) != NULL) {
+                        u64 end = strcspn(line, "\n");
+                        while (end > 0 && line[end - 1] >= '0' && line[end - 1] <= '9') {
+                                end--;
+                        }
+                        count = (u32)atoi(line + end) + 1;
+                }
+                fclose(file);
+        }
+        if (count > PB_NUMA_MAX_NODES) {
+                count = PB_NUMA_MAX_NODES;
+        }
+        __atomic_store_n(&pb_numa_nodes, count, __ATOMIC_RELAXED);
+        return count;
+}
+
+u32 pb_numa_current_node() {
+        unsigned int cpu;
+        unsigned int node;
+        if (getcpu(&cpu, &node) != 0) {
+                return 0;
+        }
+        return node < pb_numa_node_count() ? node : 0;
+}
+
+int pb_numa_apply(void* memory, u64 size, NumaPolicy policy) {
+        u64 mask;
+        int mode;
+        switch (policy.mode) {
+                case PB_NUMA_DEFAULT:
+                        return 0;
+                case PB_NUMA_BIND:
+                        pb_assert(policy.node < PB_NUMA_MAX_NODES);
+                        mode = PB_MPOL_BIND;
+                        mask = 1ULL << policy.node;
+                        break;
+                case PB_NUMA_INTERLEAVE:
+                        mode = PB_MPOL_INTERLEAVE;
+                        mask = pb_numa_node_count() == 64 ? ~0ULL : (1ULL << pb_numa_node_count()) - 1;
+                        break;
+                case PB_NUMA_LOCAL:
+                        pb_assert(policy.node < PB_NUMA_MAX_NODES);
+                        mode = PB_MPOL_PREFERRED;
+                        mask = 1ULL << policy.node;
+                        break;
+                default:
+                        pb_assert(0);
+        }
+        // The kernel reads maxnode - 1 bits; offline nodes in an interleave mask are skipped
+        if (syscall(SYS_mbind, memory, size, mode, &mask, PB_NUMA_MAX_NODES + 1, 0) != 0) {
+                return -1;
+        }
+        return 0;
+}
+
+int pb_numa_node_of(void* address) {
+        int node = -1;
+        if (syscall(SYS_get_mempolicy, &node, NULL, 0, address, PB_MPOL_F_NODE | PB_MPOL_F_ADDR) != 0) {
+                return -1;
+        }
+        return node;
+}
+
+static __thread u32 pb_numa_thread_node = 0;
+static __thread u32 pb_numa_thread_refresh = 0;
+
+NumaArenaSet* pb_numa_arena_set_create(u64 capacity_per_node) {
+        NumaArenaSet* set = (NumaArenaSet*)pb_pool_map_aligned(pb_align_up(sizeof(NumaArenaSet), 4096), 64);
+        set->node_count = pb_numa_node_count();
+        for (u32 node = 0; node < set->node_count; node++) {
+                NumaPolicy policy = {PB_NUMA_BIND, node};
+                set->arenas[node] = pb_allocator_create_numa(PB_ALLOCATOR_CONCURRENT_ARENA, capacity_per_node, policy);
+        }
+        return set;
+}
+
+void pb_numa_arena_set_release(Allocator* allocator) {
+        NumaArenaSet* set = allocator->ctx.numa_arena_set;
+        for (u32 node = 0; node < set->node_count; node++) {
+                pb_concurrent_arena_release(&set->arenas[node]);
+        }
+        munmap(set, pb_align_up(sizeof(NumaArenaSet), 4096));
+        allocator->ctx.numa_arena_set = NULL;
+}
+
+void* pb_numa_arena_set_allocate(Allocator* allocator, u64 size) {
+        NumaArenaSet* set = allocator->ctx.numa_arena_set;
+        if (pb_numa_thread_refresh == 0) {
+                pb_numa_thread_node = pb_numa_current_node();
+                pb_numa_thread_refresh = PB_NUMA_NODE_REFRESH;
+        }
+        pb_numa_thread_refresh--;
+        Allocator* arena = &set->arenas[pb_numa_thread_node < set->node_count ? pb_numa_thread_node : 0];
+        return pb_concurrent_arena_allocate(arena, size);
+}
+
+void pb_numa_arena_set_deallocate(Allocator* allocator, void* memory) {
+}
+
+void pb_numa_arena_set_set_auto_align(Allocator* allocator, u64 align) {
+        NumaArenaSet* set = allocator->ctx.numa_arena_set;
+        for (u32 node = 0; node < set->node_count; node++) {
+                pb_concurrent_arena_set_auto_align(&set->arenas[node], align);
+        }
+}
+
+void pb_numa_arena_set_reset(Allocator* allocator) {
+        NumaArenaSet* set = allocator->ctx.numa_arena_set;
+        for (u32 node = 0; node < set->node_count; node++) {
+                pb_concurrent_arena_reset(&set->arenas[node]);
+        }
+}
+
+static inline u64 pb_tracking_bucket(u64 size) {
+        u64 bucket = size == 0 ? 0 : 63 - __builtin_clzll(size);
+        return bucket < PB_TRACKING_HISTOGRAM_BUCKETS ? bucket : PB_TRACKING_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void pb_tracking_max(i64* peak, i64 value) {
+        i64 current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+        while (value > current && !__atomic_compare_exchange_n(peak, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+}
+
+// Linear probing, a slot is claimed with a CAS on its address and never given back
+static TrackingSite* pb_tracking_site_find(TrackingAllocator* tracking, u64 address, int insert) {
+        u64 mask = PB_TRACKING_MAX_SITES - 1;
+        u64 index = pb_hash_u64(address) & mask;
+        for (u64 probe = 0; probe < PB_TRACKING_MAX_SITES; probe++) {
+                TrackingSite* site = &tracking->sites[(index + probe) & mask];
+                u64 current = __atomic_load_n(&site->address, __ATOMIC_ACQUIRE);
+                if (current == 0) {
+                        if (!insert) {
+                                return NULL;
+                        }
+                        if (__atomic_compare_exchange_n(&site->address, &current, address, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                                return site;
+                        }
+                }
+                if (current == address) {
+                        return site;
+                }
+        }
+        if (!insert) {
+                return NULL;
+        }
+        __atomic_fetch_add(&tracking->dropped_sites, 1, __ATOMIC_RELAXED);
+        return &tracking->overflow;
+}
+
+static __thread TrackingThreadCache pb_tracking_caches[PB_TRACKING_MAX_ALLOCATORS];
+static TrackingAllocator* pb_tracking_allocators[PB_TRACKING_MAX_ALLOCATORS];
+static u64 pb_tracking_next_id = 1;
+static pthread_key_t pb_tracking_thread_key;
+static pthread_once_t pb_tracking_thread_key_once = PTHREAD_ONCE_INIT;
+
+static void pb_tracking_entry_flush(TrackingAllocator* tracking, TrackingCacheEntry* entry) {
+        TrackingSite* site = entry->site;
+        if (site == NULL) {
+                return;
+        }
+        if (entry->allocations > 0) {
+                __atomic_fetch_add(&site->allocations, entry->allocations, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&site->bytes, entry->bytes, __ATOMIC_RELAXED);
+                for (u64 i = 0; i < PB_TRACKING_HISTOGRAM_BUCKETS; i++) {
+                        if (entry->histogram[i] > 0) {
+                                __atomic_fetch_add(&site->histogram[i], entry->histogram[i], __ATOMIC_RELAXED);
+                        }
+                }
+                memset(entry->histogram, 0, sizeof(entry->histogram));
+        }
+        if (entry->frees > 0) {
+                __atomic_fetch_add(&site->frees, entry->frees, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&site->lifetime_cycles, entry->lifetime_cycles, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&site->lifetime_samples, entry->lifetime_samples, __ATOMIC_RELAXED);
+        }
+        if (entry->live_bytes > 0) {
+                pb_tracking_max(&site->peak_bytes, __atomic_add_fetch(&site->live_bytes, entry->live_bytes, __ATOMIC_RELAXED));
+                pb_tracking_max(&tracking->peak_bytes, __atomic_add_fetch(&tracking->live_bytes, entry->live_bytes, __ATOMIC_RELAXED));
+        } else if (entry->live_bytes < 0) {
+                __atomic_add_fetch(&site->live_bytes, entry->live_bytes, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&tracking->live_bytes, entry->live_bytes, __ATOMIC_RELAXED);
+        }
+        entry->allocations = 0;
+        entry->frees = 0;
+        entry->bytes = 0;
+        entry->lifetime_cycles = 0;
+        entry->lifetime_samples = 0;
+        entry->live_bytes = 0;
+}
+
+static void pb_tracking_cache_flush(TrackingThreadCache* cache) {
+        for (u64 i = 0; i < PB_TRACKING_CACHE_SIZE; i++) {
+                pb_tracking_entry_flush(cache->tracking, &cache->entries[i]);
+        }
+        cache->events = 0;
+}
+
+// Deltas of exiting threads are only kept if their allocator is still alive
+static void pb_tracking_thread_exit(void* value) {
+        for (u64 i = 0; i < PB_TRACKING_MAX_ALLOCATORS; i++) {
+                TrackingThreadCache* cache = &pb_tracking_caches[i];
+                TrackingAllocator* tracking = __atomic_load_n(&pb_tracking_allocators[i], __ATOMIC_ACQUIRE);
+                if (cache->tracking != NULL && cache->tracking == tracking && cache->tracking_id == tracking->id) {
+                        pb_tracking_cache_flush(cache);
+                }
+        }
+}
+
+static void pb_tracking_thread_key_create() {
+        pthread_key_create(&pb_tracking_thread_key, pb_tracking_thread_exit);
+}
+
+// Entries of a released allocator are dropped when its slot is reused
+static inline TrackingThreadCache* pb_tracking_thread_cache(TrackingAllocator* tracking) {
+        TrackingThreadCache* cache = &pb_tracking_caches[tracking->id % PB_TRACKING_MAX_ALLOCATORS];
+        if (__builtin_expect(cache->tracking != tracking || cache->tracking_id != tracking->id, 0)) {
+                memset(cache, 0, sizeof(TrackingThreadCache));
+                cache->tracking = tracking;
+                cache->tracking_id = tracking->id;
+                cache->random = (u64)cache | 1;
+                pthread_setspecific(pb_tracking_thread_key, cache);
+        }
+        return cache;
+}
+
+// Frees pass the site from the header, the overflow site has its own entry under address 0
+static inline TrackingCacheEntry* pb_tracking_cache_entry(TrackingAllocator* tracking, TrackingThreadCache* cache, u64 address, TrackingSite* site) {
+        TrackingCacheEntry* entry = &cache->entries[(address ^ (address >> 12)) % PB_TRACKING_CACHE_SIZE];
+        if (__builtin_expect(entry->address != address || entry->site == NULL, 0)) {
+                pb_tracking_entry_flush(tracking, entry);
+                entry->address = address;
+                entry->site = site != NULL ? site : pb_tracking_site_find(tracking, address, 1);
+        }
+        return entry;
+}
+
+static inline void pb_tracking_cache_event(TrackingThreadCache* cache) {
+        if (__builtin_expect(++cache->events >= PB_TRACKING_FLUSH_EVENTS, 0)) {
+                pb_tracking_cache_flush(cache);
+        }
+}
+
+Allocator pb_tracking_allocator_create(Allocator* inner) {
+        Allocator allocator;
+        pthread_once(&pb_tracking_thread_key_once, pb_tracking_thread_key_create);
+        // Zeroed by mmap, site pages are only faulted in once a site hashes there
+        TrackingAllocator* tracking = (TrackingAllocator*)pb_pool_map_aligned(pb_align_up(sizeof(TrackingAllocator), 4096), 64);
+        tracking->inner = inner;
+        tracking->id = __atomic_fetch_add(&pb_tracking_next_id, 1, __ATOMIC_RELAXED);
+        tracking->header_size = sizeof(TrackingHeader);
+        __atomic_store_n(&pb_tracking_allocators[tracking->id % PB_TRACKING_MAX_ALLOCATORS], tracking, __ATOMIC_RELEASE);
+        allocator.allocate = pb_tracking_allocate;
+        allocator.deallocate = pb_tracking_deallocate;
+        allocator.set_auto_align = pb_tracking_set_auto_align;
+        allocator.reallocate = pb_tracking_reallocate;
+        allocator.ctx.tracking = tracking;
+        return allocator;
+}
+
+void pb_tracking_allocator_release(Allocator* allocator) {
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        __atomic_compare_exchange_n(&pb_tracking_allocators[tracking->id % PB_TRACKING_MAX_ALLOCATORS], &tracking, NULL,
+                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        memset(&pb_tracking_caches[tracking->id % PB_TRACKING_MAX_ALLOCATORS], 0, sizeof(TrackingThreadCache));
+        munmap(tracking, pb_align_up(sizeof(TrackingAllocator), 4096));
+        allocator->ctx.tracking = NULL;
+}
+
+void* pb_tracking_allocate_site(Allocator* allocator, u64 size, u64 address) {
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        u64 header_size = tracking->header_size;
+        u8* base = (u8*)tracking->inner->allocate(tracking->inner, size + header_size);
+        if (base == NULL) {
+                return NULL;
+        }
+        TrackingThreadCache* cache = pb_tracking_thread_cache(tracking);
+        TrackingCacheEntry* entry = pb_tracking_cache_entry(tracking, cache, address, NULL);
+        TrackingHeader* header = (TrackingHeader*)(base + header_size) - 1;
+        header->site = entry->site;
+        header->size = size;
+        // xorshift, a fixed stride would alias with loops over a few sites
+        cache->random ^= cache->random << 13;
+        cache->random ^= cache->random >> 7;
+        cache->random ^= cache->random << 17;
+        header->allocated_at = (cache->random & (PB_TRACKING_LIFETIME_SAMPLE - 1)) == 0 ? pb_cycles() : 0;
+        header->header_size = header_size;
+        entry->allocations++;
+        entry->bytes += size;
+        entry->live_bytes += size;
+        entry->histogram[pb_tracking_bucket(size)]++;
+        pb_tracking_cache_event(cache);
+        if (tracking->hook != NULL) {
+                tracking->hook(tracking->hook_ctx, address, size, 0, 0);
+        }
+        return base + header_size;
+}
+
+void* pb_tracking_allocate(Allocator* allocator, u64 size) {
+        return pb_tracking_allocate_site(allocator, size, (u64)__builtin_return_address(0));
+}
+
+void pb_tracking_deallocate(Allocator* allocator, void* memory) {
+        if (memory == NULL) {
+                return;
+        }
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        TrackingHeader* header = (TrackingHeader*)memory - 1;
+        TrackingSite* site = header->site;
+        u64 size = header->size;
+        u64 lifetime = header->allocated_at != 0 ? pb_cycles() - header->allocated_at : 0;
+        TrackingThreadCache* cache = pb_tracking_thread_cache(tracking);
+        TrackingCacheEntry* entry = pb_tracking_cache_entry(tracking, cache, site->address, site);
+        entry->frees++;
+        if (header->allocated_at != 0) {
+                entry->lifetime_cycles += lifetime;
+                entry->lifetime_samples++;
+        }
+        entry->live_bytes -= size;
+        pb_tracking_cache_event(cache);
+        if (tracking->hook != NULL) {
+                tracking->hook(tracking->hook_ctx, site->address, size, lifetime, 1);
+        }
+        tracking->inner->deallocate(tracking->inner, (u8*)memory - header->header_size);
+}
+
+void pb_tracking_set_auto_align(Allocator* allocator, u64 align) {
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        pb_assert((align & (align - 1)) == 0);
+        tracking->inner->set_auto_align(tracking->inner, align);
+        tracking->header_size = pb_align_up(sizeof(TrackingHeader), align > 0 ? align : 1);
+}
+
+// The block keeps its original site, only the size difference is accounted
+void* pb_tracking_reallocate(Allocator* allocator, void* memory, u64 old_size, u64 new_size) {
+        if (memory == NULL) {
+                return pb_tracking_allocate_site(allocator, new_size, (u64)__builtin_return_address(0));
+        }
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        TrackingHeader* header = (TrackingHeader*)memory - 1;
+        u64 header_size = header->header_size;
+        u64 size = header->size;
+        u8* base = (u8*)tracking->inner->reallocate(tracking->inner, (u8*)memory - header_size, old_size + header_size, new_size + header_size);
+        if (base == NULL) {
+                return NULL;
+        }
+        header = (TrackingHeader*)(base + header_size) - 1;
+        header->size = new_size;
+        TrackingSite* site = header->site;
+        TrackingThreadCache* cache = pb_tracking_thread_cache(tracking);
+        TrackingCacheEntry* entry = pb_tracking_cache_entry(tracking, cache, site->address, site);
+        if (new_size > size) {
+                entry->bytes += new_size - size;
+        }
+        entry->live_bytes += (i64)new_size - (i64)size;
+        // A large resize is a likely peak, publish it now
+        pb_tracking_entry_flush(tracking, entry);
+        return base + header_size;
+}
+
+void pb_tracking_set_hook(Allocator* allocator, TrackingHook hook, void* ctx) {
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        tracking->hook_ctx = ctx;
+        tracking->hook = hook;
+}
+
+void pb_tracking_flush(Allocator* allocator) {
+        pb_tracking_cache_flush(pb_tracking_thread_cache(allocator->ctx.tracking));
+}
+
+TrackingSite* pb_tracking_site_get(Allocator* allocator, u64 address) {
+        return pb_tracking_site_find(allocator->ctx.tracking, address, 0);
+}
+
+static int pb_tracking_site_compare(const void* a, const void* b) {
+        const TrackingSite* left = *(const TrackingSite* const*)a;
+        const TrackingSite* right = *(const TrackingSite* const*)b;
+        if (left->live_bytes != right->live_bytes) {
+                return left->live_bytes > right->live_bytes ? -1 : 1;
+        }
+        if (left->bytes != right->bytes) {
+                return left->bytes > right->bytes ? -1 : 1;
+        }
+        return 0;
+}
+
+void pb_tracking_report(Allocator* allocator, FILE* file) {
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        TrackingSite* sites[PB_TRACKING_MAX_SITES + 1];
+        u64 count = 0;
+        pb_tracking_flush(allocator);
+        for (u64 i = 0; i < PB_TRACKING_MAX_SITES; i++) {
+                if (tracking->sites[i].address != 0) {
+                        sites[count++] = &tracking->sites[i];
+                }
+        }
+        if (tracking->overflow.allocations > 0) {
+                sites[count++] = &tracking->overflow;
+        }
+        qsort(sites, count, sizeof(TrackingSite*), pb_tracking_site_compare);
+        fprintf(file, "live bytes %lld peak bytes %lld sites %llu dropped sites %llu\n",
+                        tracking->live_bytes, tracking->peak_bytes, count, tracking->dropped_sites);
+        fprintf(file, "%18s %12s %12s %14s %14s %14s %16s\n",
+                        "site", "allocations", "frees", "bytes", "live bytes", "peak bytes", "avg lifetime");
+        for (u64 i = 0; i < count; i++) {
+                TrackingSite* site = sites[i];
+                fprintf(file, "%#18llx %12llu %12llu %14llu %14lld %14lld %16llu\n",
+                                site->address, site->allocations, site->frees, site->bytes,
+                                site->live_bytes, site->peak_bytes,
+                                site->lifetime_samples > 0 ? site->lifetime_cycles / site->lifetime_samples : 0);
+                fprintf(file, "%18s", "sizes");
+                for (u64 bucket = 0; bucket < PB_TRACKING_HISTOGRAM_BUCKETS; bucket++) {
+                        if (site->histogram[bucket] > 0) {
+                                fprintf(file, " [%llu, %llu): %llu", 1ULL << bucket, 2ULL << bucket, site->histogram[bucket]);
+                        }
+                }
+                fprintf(file, "\n");
+        }
+}
+
+#if defined(__cplusplus) && defined(PB_TRACKING_NEW_DELETE)
+#include <new>
+
+static Allocator pb_new_delete_system;
+static Allocator pb_new_delete_tracking;
+static pthread_once_t pb_new_delete_once = PTHREAD_ONCE_INIT;
+
+// operator new can run before static constructors, so initialization is lazy
+static void pb_new_delete_init() {
+        pb_new_delete_system = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+        pb_new_delete_tracking = pb_tracking_allocator_create(&pb_new_delete_system);
+}
+
+Allocator* pb_tracking_new_delete_allocator() {
+        pthread_once(&pb_new_delete_once, pb_new_delete_init);
+        return &pb_new_delete_tracking;
+}
+
+static inline void* pb_new(size_t size, u64 site) {
+        void* memory = pb_tracking_allocate_site(pb_tracking_new_delete_allocator(), size, site);
+        if (memory == NULL) {
+                throw std::bad_alloc();
+        }
+        return memory;
+}
+
+// noinline, the return address is only the caller of new when there is a call
+__attribute__((noinline)) void* operator new(size_t size) {
+        return pb_new(size, (u64)__builtin_return_address(0));
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+        return pb_new(size, (u64)__builtin_return_address(0));
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept {
+        return pb_tracking_allocate_site(pb_tracking_new_delete_allocator(), size, (u64)__builtin_return_address(0));
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+        return pb_tracking_allocate_site(pb_tracking_new_delete_allocator(), size, (u64)__builtin_return_address(0));
+}
+
+void operator delete(void* memory) noexcept {
+        pb_tracking_deallocate(pb_tracking_new_delete_allocator(), memory);
+}
+
+void operator delete[](void* memory) noexcept {
+        pb_tracking_deallocate(pb_tracking_new_delete_allocator(), memory);
+}
+
+void operator delete(void* memory, size_t size) noexcept {
+        pb_tracking_deallocate(pb_tracking_new_delete_allocator(), memory);
+}
+
+void operator delete[](void* memory, size_t size) noexcept {
+        pb_tracking_deallocate(pb_tracking_new_delete_allocator(), memory);
+}
+#endif
+
+u64 pb_hash_u64(u64 key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+}
+
+u64 pb_hash_bytes(const void* data, u64 length) {
+        const u8* p = (const u8*)data;
+        u64 hash = 0x9e3779b97f4a7c15ULL ^ (length * 0xff51afd7ed558ccdULL);
+        u64 tail = 0;
+        if (length >= 8) {
+                u64 left = length;
+                while (left > 8) {
+                        u64 word;
+                        memcpy(&word, p, 8);
+                        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+                        hash ^= hash >> 32;
+                        p += 8;
+                        left -= 8;
+                }
+                // Last word overlaps the previous one instead of a variable length copy
+                memcpy(&tail, (const u8*)data + length - 8, 8);
+        } else if (length >= 4) {
+                u32 low, high;
+                memcpy(&low, p, 4);
+                memcpy(&high, p + length - 4, 4);
+                tail = ((u64)high << 32) | low;
+        } else if (length > 0) {
+                tail = ((u64)p[0] << 16) | ((u64)p[length / 2] << 8) | p[length - 1];
+        }
+        return pb_hash_u64(hash ^ tail);
+}
+
+static inline u32 pb_hash_map_match(const u8* ctrl, u8 value) {
+        __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+        return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+}
+
+// Empty and deleted are the only control bytes with the high bit set
+static inline u32 pb_hash_map_match_free(const u8* ctrl) {
+        return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+
+static inline void pb_hash_map_set_ctrl(HashMap* map, u64 index, u8 value) {
+        map->ctrl[index] = value;
+        if (index < PB_HASH_MAP_GROUP_SIZE) {
+                map->ctrl[map->capacity + index] = value;
+        }
+}
+
+static void pb_hash_map_allocate(HashMap* map, u64 capacity) {
+        u64 ctrl_size = pb_align_up(capacity + PB_HASH_MAP_GROUP_SIZE, 16);
+        u8* memory = (u8*)map->allocator->allocate(map->allocator, ctrl_size + capacity * map->slot_size);
+        map->ctrl = memory;
+        map->slots = memory + ctrl_size;
+        map->capacity = capacity;
+        map->size = 0;
+        map->growth_left = capacity - capacity / 8;
+        pb_memset(map->ctrl, PB_HASH_MAP_EMPTY, capacity + PB_HASH_MAP_GROUP_SIZE);
+}
+
+void pb_hash_map_init(HashMap* map, Allocator* allocator, enum HashMapKeyType key_type, u64 value_size, u64 capacity) {
+        map->allocator = allocator;
+        map->key_type = key_type;
+        map->key_size = key_type == PB_HASH_MAP_KEY_STRING ? sizeof(HashMapStringKey) : sizeof(u64);
+        map->value_size = value_size;
+        map->slot_size = pb_align_up(map->key_size + value_size, 8);
+        u64 slots = PB_HASH_MAP_GROUP_SIZE;
+        while (slots - slots / 8 < capacity) {
+                slots *= 2;
+        }
+        pb_hash_map_allocate(map, slots);
+}
+
+void pb_hash_map_clear(HashMap* map) {
+        pb_hash_map_for_each(map, i) {
+                if (map->key_type == PB_HASH_MAP_KEY_STRING) {
+                        map->allocator->deallocate(map->allocator, (void*)pb_hash_map_key_string(map, i)->data);
+                }
+        }
+        pb_memset(map->ctrl, PB_HASH_MAP_EMPTY, map->capacity + PB_HASH_MAP_GROUP_SIZE);
+        map->size = 0;
+        map->growth_left = map->capacity - map->capacity / 8;
+}
+
+void pb_hash_map_release(HashMap* map) {
+        pb_hash_map_clear(map);
+        map->allocator->deallocate(map->allocator, map->ctrl);
+        map->ctrl = NULL;
+        map->slots = NULL;
+        map->capacity = 0;
+}
+
+u64 pb_hash_map_next(HashMap* map, u64 index) {
+        while (index < map->capacity) {
+                // Full slots are the ones with the high bit clear
+                u32 full = ~pb_hash_map_match_free(map->ctrl + index) & 0xffff;
+                if (full != 0) {
+                        u64 next = index + __builtin_ctz(full);
+                        return next < map->capacity ? next : map->capacity;
+                }
+                index += PB_HASH_MAP_GROUP_SIZE;
+        }
+        return map->capacity;
+}
+
+static inline u64 pb_hash_map_slot_hash(HashMap* map, u64 index) {
+        if (map->key_type == PB_HASH_MAP_KEY_STRING) {
+                return pb_hash_map_key_string(map, index)->hash;
+        }
+        return pb_hash_u64(pb_hash_map_key_u64(map, index));
+}
+
+// First empty or deleted slot on the probe sequence of hash
+static inline u64 pb_hash_map_find_free(HashMap* map, u64 hash) {
+        u64 mask = map->capacity - 1;
+        u64 pos = (hash >> 7) & mask;
+        u64 stride = 0;
+        while (1) {
+                u32 free_slots = pb_hash_map_match_free(map->ctrl + pos);
+                if (free_slots != 0) {
+                        return (pos + __builtin_ctz(free_slots)) & mask;
+                }
+                stride += PB_HASH_MAP_GROUP_SIZE;
+                pos = (pos + stride) & mask;
+        }
+}
+
+static void pb_hash_map_rehash(HashMap* map, u64 capacity) {
+        HashMap old = *map;
+        pb_hash_map_allocate(map, capacity);
+        for (u64 i = pb_hash_map_next(&old, 0); i < old.capacity; i = pb_hash_map_next(&old, i + 1)) {
+                u64 hash = pb_hash_map_slot_hash(&old, i);
+                u64 index = pb_hash_map_find_free(map, hash);
+                pb_hash_map_set_ctrl(map, index, hash & 0x7f);
+                pb_memcpy(map->slots + index * map->slot_size, old.slots + i * old.slot_size, map->slot_size);
+        }
+        map->size = old.size;
+        map->growth_left -= old.size;
+        map->allocator->deallocate(map->allocator, old.ctrl);
+}
+
+// Probe for key, returns the slot index or map->capacity
+static inline u64 pb_hash_map_find(HashMap* map, u64 hash, u64 key, const char* string, u64 length) {
+        u64 mask = map->capacity - 1;
+        u64 pos = (hash >> 7) & mask;
+        u64 stride = 0;
+        u8 h2 = hash & 0x7f;
+        while (1) {
+                u32 matches = pb_hash_map_match(map->ctrl + pos, h2);
+                while (matches != 0) {
+                        u64 index = (pos + __builtin_ctz(matches)) & mask;
+                        if (map->key_type == PB_HASH_MAP_KEY_U64) {
+                                if (pb_hash_map_key_u64(map, index) == key) {
+                                        return index;
+                                }
+                        } else {
+                                HashMapStringKey* slot_key = pb_hash_map_key_string(map, index);
+                                if (slot_key->hash == hash && slot_key->length == length && memcmp(slot_key->data, string, length) == 0) {
+                                        return index;
+                                }
+                        }
+                        matches &= matches - 1;
+                }
+                if (pb_hash_map_match(map->ctrl + pos, PB_HASH_MAP_EMPTY) != 0) {
+                        return map->capacity;
+                }
+                stride += PB_HASH_MAP_GROUP_SIZE;
+                pos = (pos + stride) & mask;
+        }
+}
+
+static inline u64 pb_hash_map_insert_slot(HashMap* map, u64 hash) {
+        if (map->growth_left == 0) {
+                // Mostly tombstones rehash in place, otherwise double
+                pb_hash_map_rehash(map, map->size * 2 < map->capacity - map->capacity / 8 ? map->capacity : map->capacity * 2);
+        }
+        u64 index = pb_hash_map_find_free(map, hash);
+        if (map->ctrl[index] == PB_HASH_MAP_EMPTY) {
+                map->growth_left--;
+        }
+        pb_hash_map_set_ctrl(map, index, hash & 0x7f);
+        map->size++;
+        pb_memset(map->slots + index * map->slot_size + map->key_size, 0, map->value_size);
+        return index;
+}
+
+void* pb_hash_map_get_u64(HashMap* map, u64 key) {
+        u64 index = pb_hash_map_find(map, pb_hash_u64(key), key, NULL, 0);
+        return index == map->capacity ? NULL : pb_hash_map_value(map, index);
+}
+
+void* pb_hash_map_put_u64(HashMap* map, u64 key) {
+        u64 hash = pb_hash_u64(key);
+        u64 index = pb_hash_map_find(map, hash, key, NULL, 0);
+        if (index == map->capacity) {
+                index = pb_hash_map_insert_slot(map, hash);
+                pb_hash_map_key_u64(map, index) = key;
+        }
+        return pb_hash_map_value(map, index);
+}
+
+static inline void pb_hash_map_remove_index(HashMap* map, u64 index) {
+        // A slot in a group that never filled up can go back to empty without breaking probes
+        u64 mask = map->capacity - 1;
+        u64 before = (index - PB_HASH_MAP_GROUP_SIZE) & mask;
+        u32 empty_after = pb_hash_map_match(map->ctrl + index, PB_HASH_MAP_EMPTY);
+        u32 empty_before = pb_hash_map_match(map->ctrl + before, PB_HASH_MAP_EMPTY);
+        if (empty_after != 0 && empty_before != 0 &&
+                        __builtin_ctz(empty_after) + __builtin_clz(empty_before << 16 | 0x8000) < PB_HASH_MAP_GROUP_SIZE) {
+                pb_hash_map_set_ctrl(map, index, PB_HASH_MAP_EMPTY);
+                map->growth_left++;
+        } else {
+                pb_hash_map_set_ctrl(map, index, PB_HASH_MAP_DELETED);
+        }
+        map->size--;
+}
+
+int pb_hash_map_remove_u64(HashMap* map, u64 key) {
+        u64 index = pb_hash_map_find(map, pb_hash_u64(key), key, NULL, 0);
+        if (index == map->capacity) {
+                return 0;
+        }
+        pb_hash_map_remove_index(map, index);
+        return 1;
+}
+
+void* pb_hash_map_get_string(HashMap* map, const char* key, u64 length) {
+        u64 index = pb_hash_map_find(map, pb_hash_bytes(key, length), 0, key, length);
+        return index == map->capacity ? NULL : pb_hash_map_value(map, index);
+}
+
+void* pb_hash_map_put_string(HashMap* map, const char* key, u64 length) {
+        u64 hash = pb_hash_bytes(key, length);
+        u64 index = pb_hash_map_find(map, hash, 0, key, length);
+        if (index == map->capacity) {
+                char* data = (char*)map->allocator->allocate(map->allocator, length + 1);
+                pb_memcpy(data, key, length);
+                data[length] = 0;
+                index = pb_hash_map_insert_slot(map, hash);
+                HashMapStringKey* slot_key = pb_hash_map_key_string(map, index);
+                slot_key->data = data;
+                slot_key->length = length;
+                slot_key->hash = hash;
+        }
+        return pb_hash_map_value(map, index);
+}
+
+int pb_hash_map_remove_string(HashMap* map, const char* key, u64 length) {
+        u64 index = pb_hash_map_find(map, pb_hash_bytes(key, length), 0, key, length);
+        if (index == map->capacity) {
+                return 0;
+        }
+        map->allocator->deallocate(map->allocator, (void*)pb_hash_map_key_string(map, index)->data);
+        pb_hash_map_remove_index(map, index);
+        return 1;
+}
+
 Allocator pb_allocator_create(enum AllocatorType type, u64 capacity) {
+        NumaPolicy policy = {PB_NUMA_DEFAULT, 0};
+        return pb_allocator_create_numa(type, capacity, policy);
+}
+
+Allocator pb_allocator_create_numa(enum AllocatorType type, u64 capacity, NumaPolicy policy) {
+        if (policy.mode == PB_NUMA_LOCAL) {
+                policy.node = pb_numa_current_node();
+        }
         Allocator allocator;
         switch (type) {
                 case PB_ALLOCATOR_SYSTEM:
                         allocator.allocate = pb_sys_allocate;
                         allocator.deallocate = pb_sys_deallocate;
                         allocator.set_auto_align = pb_sys_set_auto_align;
+                        allocator.reallocate = pb_sys_reallocate;
+                        allocator.ctx.system_allocator.alignment = 16;
+                        allocator.ctx.system_allocator.numa = policy;
                         break;
                 case PB_ALLOCATOR_ARENA:
                         allocator.allocate = pb_arena_push;
                         allocator.deallocate = pb_arena_deallocate;
                         allocator.set_auto_align = pb_arena_set_auto_align;
+                        allocator.reallocate = pb_arena_reallocate;
                         allocator.ctx.arena = pb_arena_allocate(capacity);
+                        pb_numa_apply(allocator.ctx.arena.memory, allocator.ctx.arena.capacity, policy);
+                        break;
+                case PB_ALLOCATOR_ARENA_GROWABLE:
+                        allocator.allocate = pb_arena_push;
+                        allocator.deallocate = pb_arena_deallocate;
+                        allocator.set_auto_align = pb_arena_set_auto_align;
+                        allocator.reallocate = pb_arena_reallocate;
+                        allocator.ctx.arena = pb_arena_reserve(capacity, PB_ARENA_COMMIT_SIZE);
+                        // The policy stays with the reservation as it's committed
+                        pb_numa_apply(allocator.ctx.arena.memory, allocator.ctx.arena.capacity, policy);
+                        break;
+                case PB_ALLOCATOR_POOL:
+                        allocator.allocate = pb_pool_allocate;
+                        allocator.deallocate = pb_pool_deallocate;
+                        allocator.set_auto_align = pb_pool_set_auto_align;
+                        allocator.reallocate = pb_allocator_reallocate_copy;
+                        allocator.ctx.pool = pb_pool_create();
+                        allocator.ctx.pool->numa = policy;
+                        break;
+                case PB_ALLOCATOR_CONCURRENT_ARENA:
+                        allocator.allocate = pb_concurrent_arena_allocate;
+                        allocator.deallocate = pb_concurrent_arena_deallocate;
+                        allocator.set_auto_align = pb_concurrent_arena_set_auto_align;
+                        allocator.reallocate = pb_allocator_reallocate_copy;
+                        allocator.ctx.concurrent_arena = pb_concurrent_arena_create(capacity, PB_CONCURRENT_ARENA_CHUNK_SIZE);
+                        pb_numa_apply(allocator.ctx.concurrent_arena->memory, capacity, policy);
+                        break;
+                case PB_ALLOCATOR_NUMA_ARENA_SET:
+                        allocator.allocate = pb_numa_arena_set_allocate;
+                        allocator.deallocate = pb_numa_arena_set_deallocate;
+                        allocator.set_auto_align = pb_numa_arena_set_set_auto_align;
+                        allocator.reallocate = pb_allocator_reallocate_copy;
+                        allocator.ctx.numa_arena_set = pb_numa_arena_set_create(capacity);
                         break;
                 default:
                         pb_assert(0);
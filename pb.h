@@ -1,11 +1,19 @@
 #ifndef PB_H
 #define PB_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <x86intrin.h>
 
 typedef unsigned char u8;
@@ -25,30 +33,247 @@ typedef long long i64;
         }
 #define pb_debug(var) printf("%s: %d\n", #var, var)
 
+#define PB_ARENA_COMMIT_SIZE (64 * 1024)
+#define PB_ARENA_DECOMMIT_THRESHOLD (1024 * 1024)
+
+// Reserves capacity bytes of address space and commits them in commit_size
+// chunks as pos grows. commit_size 0 means everything is committed up front.
 typedef struct _Arena {
         void* memory;
         u64 capacity;
+        u64 committed;
+        u64 commit_size;
+        u64 decommit_threshold;
         u64 pos;
+        // Bytes below dirty_end were handed out before, above it pages are fresh and zero
+        u64 dirty_end;
         u64 auto_align;
 } Arena;
 
+// Where the pages of an allocator go, applied with mbind before they are first
+// touched. DEFAULT leaves it to the kernel (first touch), BIND only takes pages
+// from node, INTERLEAVE spreads them page by page over the online nodes and
+// LOCAL prefers the node of the thread creating the allocator, falling back to
+// the others when it's full. Without NUMA support mbind fails and placement
+// stays first touch.
+#define PB_NUMA_MAX_NODES 64
+
+enum NumaMode {
+        PB_NUMA_DEFAULT,
+        PB_NUMA_BIND,
+        PB_NUMA_INTERLEAVE,
+        PB_NUMA_LOCAL,
+};
+
+typedef struct _NumaPolicy {
+        enum NumaMode mode;
+        u32 node;
+} NumaPolicy;
+
+// System allocations carry this header right before the returned pointer.
+// From PB_SYS_MAP_THRESHOLD on they are mmapped so reallocate can mremap.
+#define PB_SYS_MAP_THRESHOLD (64 * 1024)
+
 typedef struct _SystemAllocator {
         u64 alignment;
+        // malloc pages can't be placed, with a policy every block is mapped
+        NumaPolicy numa;
 } SystemAllocator;
 
+typedef struct _SystemAllocationHeader {
+        u64 mapped_size;  // 0 when it comes from malloc
+        u64 offset;       // from the malloc/mmap base to the returned pointer
+} SystemAllocationHeader;
+
+// Size class pool: power of two classes carved from PB_POOL_SLAB_SIZE aligned
+// slabs, per-thread free lists refilled and drained in PB_POOL_BATCH batches
+// through a shared depot. Sizes above the last class get their own mapping.
+#define PB_POOL_MIN_CLASS_SHIFT 4
+#define PB_POOL_CLASS_COUNT 11
+#define PB_POOL_MAX_CLASS_SIZE (1ULL << (PB_POOL_MIN_CLASS_SHIFT + PB_POOL_CLASS_COUNT - 1))
+#define PB_POOL_SLAB_SIZE (256 * 1024)
+#define PB_POOL_BATCH 32
+#define PB_POOL_MAX_POOLS 16
+
+typedef struct _PoolFreeNode {
+        struct _PoolFreeNode* next;
+        // Only valid on the first node of a batch parked in the depot
+        struct _PoolFreeNode* next_batch;
+} PoolFreeNode;
+
+// Lives at the start of every slab so deallocate finds it by masking the pointer
+typedef struct _PoolSlab {
+        u64 class_size;
+        u64 mapped_size;
+        struct _PoolSlab* next;
+} PoolSlab;
+
+typedef struct _PoolDepot {
+        pthread_mutex_t mutex;
+        PoolFreeNode* batches;
+        u8* slab_pos;
+        u8* slab_end;
+        PoolSlab* slabs;
+} __attribute__((aligned(64))) PoolDepot;
+
+typedef struct _Pool {
+        u64 id;
+        u64 alignment;
+        // Live pools are listed so thread caches are only drained into pools not yet released
+        struct _Pool* next_live;
+        // Applied to every slab mapped for the pool
+        NumaPolicy numa;
+        PoolDepot depots[PB_POOL_CLASS_COUNT];
+} Pool;
+
+typedef struct _PoolThreadCache {
+        Pool* pool;
+        u64 pool_id;
+        PoolFreeNode* heads[PB_POOL_CLASS_COUNT];
+        u32 counts[PB_POOL_CLASS_COUNT];
+        // Fresh slab range handed out by the depot, bumped without building a free list
+        u8* bump_pos[PB_POOL_CLASS_COUNT];
+        u8* bump_end[PB_POOL_CLASS_COUNT];
+} PoolThreadCache;
+
+// Arena shared by several threads: each thread claims a chunk with one
+// atomic fetch-add on pos and bumps inside it without synchronization.
+#define PB_CONCURRENT_ARENA_CHUNK_SIZE (256 * 1024)
+#define PB_CONCURRENT_ARENA_MAX 16
+
+typedef struct _ConcurrentArena {
+        void* memory;
+        u64 capacity;
+        u64 id;
+        u64 chunk_size;
+        u64 auto_align;
+        // Bumped by reset, thread chunks from an older epoch are dropped
+        u64 epoch __attribute__((aligned(64)));
+        u64 pos __attribute__((aligned(64)));
+} ConcurrentArena;
+
+typedef struct _ConcurrentArenaChunk {
+        ConcurrentArena* arena;
+        u64 arena_id;
+        u64 epoch;
+        u8* pos;
+        u8* end;
+} ConcurrentArenaChunk;
+
+// Wraps another allocator and keeps statistics per call site, the return
+// address of the allocate call. Blocks carry a TrackingHeader in front so
+// deallocate knows the site, the size and when the block was allocated.
+// Threads count into a TrackingThreadCache and add their deltas to the shared
+// sites every PB_TRACKING_FLUSH_EVENTS events, on eviction, on thread exit or
+// on pb_tracking_flush, so peaks are sampled at flush time.
+#define PB_TRACKING_MAX_SITES 4096
+// Power of two size buckets, bucket i counts sizes in [2^i, 2^(i+1))
+#define PB_TRACKING_HISTOGRAM_BUCKETS 40
+#define PB_TRACKING_CACHE_SIZE 32
+#define PB_TRACKING_FLUSH_EVENTS 4096
+#define PB_TRACKING_MAX_ALLOCATORS 8
+// rdtsc costs as much as the rest of the bookkeeping, one in this many
+// allocations is timestamped and lifetimes are averaged over those
+#define PB_TRACKING_LIFETIME_SAMPLE 16
+
+typedef struct _TrackingSite {
+        u64 address;  // 0 while the slot is free
+        u64 allocations;
+        u64 frees;
+        u64 bytes;
+        // Signed, frees flushed by one thread can land before the allocations of another
+        i64 live_bytes;
+        i64 peak_bytes;
+        // Sum of pb_cycles() between allocate and deallocate of sampled freed blocks
+        u64 lifetime_cycles;
+        u64 lifetime_samples;
+        u64 histogram[PB_TRACKING_HISTOGRAM_BUCKETS];
+} __attribute__((aligned(64))) TrackingSite;
+
+// 32 bytes so the 16 byte alignment of the wrapped allocator is kept, larger
+// alignments pad in front and header_size says how far the inner block starts
+typedef struct _TrackingHeader {
+        TrackingSite* site;
+        u64 size;
+        u64 allocated_at;  // 0 when the lifetime isn't sampled
+        u64 header_size;
+} TrackingHeader;
+
+// Called on every allocation (freed 0) and deallocation (freed 1) from the calling thread,
+// lifetime is 0 unless the block was sampled
+typedef void (*TrackingHook)(void* ctx, u64 site, u64 size, u64 lifetime, int freed);
+
+typedef struct _TrackingAllocator {
+        struct _Allocator* inner;
+        u64 id;
+        u64 header_size;
+        TrackingHook hook;
+        void* hook_ctx;
+        i64 live_bytes __attribute__((aligned(64)));
+        i64 peak_bytes;
+        u64 dropped_sites;
+        // Sites past PB_TRACKING_MAX_SITES are accounted here with address 0
+        TrackingSite overflow;
+        TrackingSite sites[PB_TRACKING_MAX_SITES];
+} TrackingAllocator;
+
+// Pending deltas of one site, direct mapped by address
+typedef struct _TrackingCacheEntry {
+        u64 address;
+        TrackingSite* site;
+        u32 allocations;
+        u32 frees;
+        u64 bytes;
+        u64 lifetime_cycles;
+        u64 lifetime_samples;
+        i64 live_bytes;
+        // At most PB_TRACKING_FLUSH_EVENTS per flush, fits in 16 bits
+        u16 histogram[PB_TRACKING_HISTOGRAM_BUCKETS];
+} TrackingCacheEntry;
+
+typedef struct _TrackingThreadCache {
+        TrackingAllocator* tracking;
+        u64 tracking_id;
+        u64 events;
+        u64 random;
+        TrackingCacheEntry entries[PB_TRACKING_CACHE_SIZE];
+} TrackingThreadCache;
+
 typedef struct _Allocator {
         void* (*allocate)(struct _Allocator* allocator, u64 size);
         void (*deallocate)(struct _Allocator* allocator, void* memory);
         void (*set_auto_align)(struct _Allocator* allocator, u64 size);
+        // Returns memory holding the first min(old_size, new_size) bytes of memory, possibly in place
+        void* (*reallocate)(struct _Allocator* allocator, void* memory, u64 old_size, u64 new_size);
         union {
           Arena arena;
           SystemAllocator system_allocator;
+          Pool* pool;
+          ConcurrentArena* concurrent_arena;
+          TrackingAllocator* tracking;
+          struct _NumaArenaSet* numa_arena_set;
         } ctx;
 } Allocator;
 
+// One concurrent arena per node, each bound to its node. Threads allocate from
+// the arena of the node they run on, looked up again every PB_NUMA_NODE_REFRESH
+// allocations so a thread that migrated follows. Nodes are numbered up to the
+// highest online one, arenas of offline nodes are never picked.
+#define PB_NUMA_NODE_REFRESH 4096
+
+typedef struct _NumaArenaSet {
+        u32 node_count;
+        Allocator arenas[PB_NUMA_MAX_NODES];
+} NumaArenaSet;
+
 enum AllocatorType {
         PB_ALLOCATOR_ARENA,
         PB_ALLOCATOR_SYSTEM,
+        PB_ALLOCATOR_ARENA_GROWABLE,
+        PB_ALLOCATOR_POOL,
+        PB_ALLOCATOR_CONCURRENT_ARENA,
+        // capacity is per node, the NUMA policy is ignored
+        PB_ALLOCATOR_NUMA_ARENA_SET,
 };
 
 
@@ -57,6 +282,9 @@ inline Arena* pb_allocator_arena_get(Allocator* allocator) {
 }
 
 Arena pb_arena_allocate(u64 capacity);
+Arena pb_arena_reserve(u64 capacity, u64 commit_size);
+void pb_arena_commit(Arena* arena, u64 end);
+void pb_arena_decommit(Arena* arena, u64 pos);
 void pb_arena_release(Allocator* arena);
 void pb_arena_set_auto_align(Allocator* arena, u64 align);
 
@@ -66,14 +294,38 @@ void* pb_arena_push_no_zero(Allocator* arena, u64 size);
 void* pb_arena_push_aligner(Allocator* arena, u64 align);
 void* pb_arena_push(Allocator* arena, u64 size);
 void pb_arena_deallocate(Allocator* allocator, void* memory_to);
+void* pb_arena_reallocate(Allocator* arena, void* memory, u64 old_size, u64 new_size);
 void pb_arena_pop_to(Allocator* arena, u64 pos);
 void pb_arena_pop(Allocator* arena, void* memory_to);
 void pb_arena_clear(Allocator* arena);
 
+// Scratch checkpoint, everything pushed after begin is popped by end
+typedef struct _ArenaTemp {
+        Allocator* allocator;
+        u64 pos;
+} ArenaTemp;
+
+ArenaTemp pb_arena_temp_begin(Allocator* arena);
+void pb_arena_temp_end(ArenaTemp temp);
+
+// pb_arena_temp_scope(&allocator) { ... } pops on scope exit, don't break/return out of it
+#define pb_arena_temp_scope(arena) \
+        for (ArenaTemp pb_arena_temp_ = pb_arena_temp_begin(arena); pb_arena_temp_.allocator != NULL; \
+             pb_arena_temp_end(pb_arena_temp_), pb_arena_temp_.allocator = NULL)
+
 inline u64 pb_align(u64 value, u64 align);
-inline void pb_memset(void* memory, u8 value, u64 size);
+inline u64 pb_align_up(u64 value, u64 align);
+void pb_memset(void* memory, u8 value, u64 size);
+void pb_memcpy(void* destination, const void* source, u64 size);
 inline u64 pb_cycles();
 
+// Benchmark and test only: fill and copy kernels kept to compare against libc, use pb_memset/pb_memcpy
+void pb_memset_bytes(void* memory, u8 value, u64 size);
+void pb_memset_sse2(void* memory, u8 value, u64 size);
+void pb_memset_avx2(void* memory, u8 value, u64 size);
+void pb_memcpy_sse2(void* destination, const void* source, u64 size);
+void pb_memcpy_avx2(void* destination, const void* source, u64 size);
+
 
 inline SystemAllocator* pb_get_allocator_system_get(Allocator* allocator) {
         return (SystemAllocator*)&allocator->ctx.system_allocator;
@@ -82,10 +334,133 @@ inline SystemAllocator* pb_get_allocator_system_get(Allocator* allocator) {
 void* pb_sys_allocate(Allocator* sys_allocator, u64 size);
 void pb_sys_deallocate(Allocator* sys_allocator, void* memory);
 void pb_sys_set_auto_align(Allocator* sys_allocator, u64 size);
+void* pb_sys_reallocate(Allocator* sys_allocator, void* memory, u64 old_size, u64 new_size);
+
+// allocate + copy + deallocate, for allocators that can't do better
+void* pb_allocator_reallocate_copy(Allocator* allocator, void* memory, u64 old_size, u64 new_size);
+
+Pool* pb_pool_create();
+void pb_pool_release(Allocator* pool);
+void* pb_pool_allocate(Allocator* pool, u64 size);
+void pb_pool_deallocate(Allocator* pool, void* memory);
+void pb_pool_set_auto_align(Allocator* pool, u64 align);
+
+ConcurrentArena* pb_concurrent_arena_create(u64 capacity, u64 chunk_size);
+void pb_concurrent_arena_release(Allocator* arena);
+void* pb_concurrent_arena_allocate(Allocator* arena, u64 size);
+void pb_concurrent_arena_deallocate(Allocator* arena, void* memory);
+void pb_concurrent_arena_set_auto_align(Allocator* arena, u64 align);
+// Phase boundary, no thread may be allocating while it runs
+void pb_concurrent_arena_reset(Allocator* arena);
+
+// Highest online node + 1, 1 when the kernel has no NUMA
+u32 pb_numa_node_count();
+// Node of the cpu the calling thread runs on right now
+u32 pb_numa_current_node();
+// mbind memory (page aligned) to the policy, 0 on success, -1 if the kernel refused
+int pb_numa_apply(void* memory, u64 size, NumaPolicy policy);
+// Node holding the page of address, -1 when unknown
+int pb_numa_node_of(void* address);
+
+NumaArenaSet* pb_numa_arena_set_create(u64 capacity_per_node);
+void pb_numa_arena_set_release(Allocator* set);
+void* pb_numa_arena_set_allocate(Allocator* set, u64 size);
+void pb_numa_arena_set_deallocate(Allocator* set, void* memory);
+void pb_numa_arena_set_set_auto_align(Allocator* set, u64 align);
+// Resets every node's arena, same rules as pb_concurrent_arena_reset
+void pb_numa_arena_set_reset(Allocator* set);
+
+// inner must outlive the tracking allocator
+Allocator pb_tracking_allocator_create(Allocator* inner);
+void pb_tracking_allocator_release(Allocator* tracking);
+void* pb_tracking_allocate(Allocator* tracking, u64 size);
+// Same as pb_tracking_allocate with an explicit call site, for wrappers like operator new
+void* pb_tracking_allocate_site(Allocator* tracking, u64 size, u64 site);
+void pb_tracking_deallocate(Allocator* tracking, void* memory);
+void pb_tracking_set_auto_align(Allocator* tracking, u64 align);
+void* pb_tracking_reallocate(Allocator* tracking, void* memory, u64 old_size, u64 new_size);
+void pb_tracking_set_hook(Allocator* tracking, TrackingHook hook, void* ctx);
+// Adds the calling thread's pending deltas to the shared sites
+void pb_tracking_flush(Allocator* tracking);
+// Site statistics, NULL if the address was never seen
+TrackingSite* pb_tracking_site_get(Allocator* tracking, u64 address);
+// Sites sorted by live bytes, then by total bytes, after flushing the calling thread
+void pb_tracking_report(Allocator* tracking, FILE* file);
+
+#if defined(__cplusplus) && defined(PB_TRACKING_NEW_DELETE)
+// Global operator new/delete go through this tracking allocator over the system one
+Allocator* pb_tracking_new_delete_allocator();
+#endif
 
 
 
 Allocator pb_allocator_create(enum AllocatorType type, u64 capacity);
+// Same with the pages placed by policy, LOCAL is resolved to the calling thread's node here
+Allocator pb_allocator_create_numa(enum AllocatorType type, u64 capacity, NumaPolicy policy);
+
+
+// Statically dispatched allocation. pb_allocate(&arena, size) on an Arena*
+// inlines the bump, on an Allocator* it goes through the function pointers.
+void* pb_arena_bump(Arena* arena, u64 size);
+void* pb_arena_bump_zero(Arena* arena, u64 size);
+void* pb_allocator_allocate(Allocator* allocator, u64 size);
+void pb_allocator_deallocate(Allocator* allocator, void* memory);
+void pb_arena_bump_deallocate(Arena* arena, void* memory);
+
+inline void* pb_arena_bump(Arena* arena, u64 size) {
+        u64 pos = arena->pos;
+        if (arena->auto_align > 0) {
+                pos += pb_align((u64)arena->memory + pos, arena->auto_align);
+        }
+        u64 end = pos + size;
+        if (__builtin_expect(end > arena->committed, 0)) {
+                pb_arena_commit(arena, end);
+        }
+        if (end > arena->dirty_end) {
+                arena->dirty_end = end;
+        }
+        arena->pos = end;
+        return (u8*)arena->memory + pos;
+}
+
+inline void* pb_arena_bump_zero(Arena* arena, u64 size) {
+        u64 dirty_end = arena->dirty_end;
+        void* result = pb_arena_bump(arena, size);
+        // Only memory reused after a pop needs zeroing, fresh mmap pages already are
+        u64 offset = (u64)result - (u64)arena->memory;
+        if (offset < dirty_end) {
+                u64 dirty_size = dirty_end - offset;
+                pb_memset(result, 0, dirty_size < size ? dirty_size : size);
+        }
+        return result;
+}
+
+inline void pb_arena_bump_deallocate(Arena* arena, void* memory) {
+}
+
+inline void* pb_allocator_allocate(Allocator* allocator, u64 size) {
+        return allocator->allocate(allocator, size);
+}
+
+inline void pb_allocator_deallocate(Allocator* allocator, void* memory) {
+        allocator->deallocate(allocator, memory);
+}
+
+#ifdef __cplusplus
+inline void* pb_allocate(Arena* arena, u64 size) { return pb_arena_bump_zero(arena, size); }
+inline void* pb_allocate(Allocator* allocator, u64 size) { return pb_allocator_allocate(allocator, size); }
+inline void pb_deallocate(Arena* arena, void* memory) { pb_arena_bump_deallocate(arena, memory); }
+inline void pb_deallocate(Allocator* allocator, void* memory) { pb_allocator_deallocate(allocator, memory); }
+#else
+#define pb_allocate(allocator, size) _Generic((allocator), \
+        Arena*: pb_arena_bump_zero, \
+        Allocator*: pb_allocator_allocate)((allocator), (size))
+#define pb_deallocate(allocator, memory) _Generic((allocator), \
+        Arena*: pb_arena_bump_deallocate, \
+        Allocator*: pb_allocator_deallocate)((allocator), (memory))
+#endif
+#define pb_push_struct(allocator, Type) ((Type*)pb_allocate((allocator), sizeof(Type)))
+#define pb_push_array(allocator, Type, count) ((Type*)pb_allocate((allocator), sizeof(Type) * (count)))
 
 
 typedef struct _DynamicArray {
@@ -105,15 +480,24 @@ typedef struct _DynamicArray {
 
 #define pb_dynamic_array_init(array, allocator, capacity) pb_dynamic_array_init_impl((void**)&array, sizeof(*array), allocator, capacity)
 #define pb_dynamic_array_push(array, value) do {\
-  pb_dynamic_array_grow((void**)&array); \
+  if (__builtin_expect(pb_dynamic_array_size(array) >= pb_dynamic_array_capacity(array), 0)) { \
+    pb_dynamic_array_grow((void**)&array); \
+  } \
   array[pb_dynamic_array_size(array)++] = value; \
 } while(0)
+#define pb_dynamic_array_reserve(array, capacity) pb_dynamic_array_reserve_impl((void**)&array, capacity)
+#define pb_dynamic_array_append(array, values, count) pb_dynamic_array_append_impl((void**)&array, values, count)
+#define pb_dynamic_array_pop(array) (array[--pb_dynamic_array_size(array)])
+#define pb_dynamic_array_shrink_to_fit(array) pb_dynamic_array_shrink_to_fit_impl((void**)&array)
 
 void pb_dynamic_array_init_impl(void** array, u64 element_size, Allocator* allocator, u64 capacity);
 void pb_dynamic_array_release(void* array, Allocator* allocator);
 void pb_dynamic_array_push_impl(void** array, void* value);
 void pb_dynamic_array_clear(void* array);
 void pb_dynamic_array_grow(void** array);
+void pb_dynamic_array_reserve_impl(void** array, u64 capacity);
+void pb_dynamic_array_append_impl(void** array, const void* values, u64 count);
+void pb_dynamic_array_shrink_to_fit_impl(void** array);
 
 
 inline void pb_dynamic_array_init_impl(void** array, u64 element_size, Allocator* allocator, u64 capacity) {
@@ -126,30 +510,64 @@ inline void pb_dynamic_array_init_impl(void** array, u64 element_size, Allocator
 }
 
 inline void pb_dynamic_array_release(void* array, Allocator* allocator) {
-  allocator->deallocate(allocator, array);
+  allocator->deallocate(allocator, pb_dynamic_array_header(array));
 }
 
 inline void pb_dynamic_array_push_impl(void** array, void* value) {
-  DynamicArrayHeader* header = pb_dynamic_array_header(array);
-  pb_dynamic_array_grow(array);
-  u8* pos = (u8*)pb_dynamic_array_start(array) + header->size;
-  memcpy(pos, value, header->element_size);
-  header->size += header->element_size;
+  DynamicArrayHeader* header = pb_dynamic_array_header(*array);
+  if (header->size >= header->capacity) {
+    pb_dynamic_array_grow(array);
+    header = pb_dynamic_array_header(*array);
+  }
+  u8* pos = (u8*)pb_dynamic_array_start(*array) + header->size * header->element_size;
+  pb_memcpy(pos, value, header->element_size);
+  header->size++;
+}
+
+// Arena arrays on top of the arena extend in place, large system arrays mremap
+inline void pb_dynamic_array_reserve_impl(void** array, u64 capacity) {
+  DynamicArrayHeader* header = pb_dynamic_array_header(*array);
+  if (capacity <= header->capacity) {
+    return;
+  }
+  Allocator* allocator = header->allocator;
+  u64 old_size = header->capacity * header->element_size + sizeof(DynamicArrayHeader);
+  u64 new_size = capacity * header->element_size + sizeof(DynamicArrayHeader);
+  header = (DynamicArrayHeader*)allocator->reallocate(allocator, header, old_size, new_size);
+  header->capacity = capacity;
+  *array = (void*)(header + 1);
 }
 
 inline void pb_dynamic_array_grow(void** array) {
   DynamicArrayHeader* header = pb_dynamic_array_header(*array);
-  if (header->size+1 >= header->capacity) {
-    u64 new_capacity = (header->capacity * 2) + 8;
-    DynamicArrayHeader* new_array = (DynamicArrayHeader*)header->allocator->allocate(header->allocator, new_capacity * header->element_size + sizeof(DynamicArrayHeader));
-    memcpy((void*)new_array, (void*)header, header->capacity * header->element_size + sizeof(DynamicArrayHeader));
+  if (header->size >= header->capacity) {
+    pb_dynamic_array_reserve_impl(array, (header->capacity * 2) + 8);
+  }
+}
 
-    new_array->capacity = new_capacity;
+inline void pb_dynamic_array_append_impl(void** array, const void* values, u64 count) {
+  DynamicArrayHeader* header = pb_dynamic_array_header(*array);
+  if (header->size + count > header->capacity) {
+    u64 new_capacity = (header->capacity * 2) + 8;
+    pb_dynamic_array_reserve_impl(array, header->size + count > new_capacity ? header->size + count : new_capacity);
+    header = pb_dynamic_array_header(*array);
+  }
+  u8* pos = (u8*)pb_dynamic_array_start(*array) + header->size * header->element_size;
+  pb_memcpy(pos, values, count * header->element_size);
+  header->size += count;
+}
 
-    *array = (void*)(new_array+1);
-    header->allocator->deallocate(header->allocator, header);
-    pb_assert(header->allocator == ((DynamicArrayHeader*)(*array)-1)->allocator);
+inline void pb_dynamic_array_shrink_to_fit_impl(void** array) {
+  DynamicArrayHeader* header = pb_dynamic_array_header(*array);
+  if (header->size == header->capacity) {
+    return;
   }
+  Allocator* allocator = header->allocator;
+  u64 old_size = header->capacity * header->element_size + sizeof(DynamicArrayHeader);
+  u64 new_size = header->size * header->element_size + sizeof(DynamicArrayHeader);
+  header = (DynamicArrayHeader*)allocator->reallocate(allocator, header, old_size, new_size);
+  header->capacity = header->size;
+  *array = (void*)(header + 1);
 }
 
 inline void pb_dynamic_array_clear(void* array) {
@@ -159,4 +577,61 @@ inline void pb_dynamic_array_clear(void* array) {
 
 
 
+// Open addressing hash map with Swiss table style metadata: one control byte
+// per slot holding 7 bits of the hash, probed 16 at a time with SSE2.
+#define PB_HASH_MAP_GROUP_SIZE 16
+#define PB_HASH_MAP_EMPTY ((u8)0x80)
+#define PB_HASH_MAP_DELETED ((u8)0xfe)
+
+enum HashMapKeyType {
+        PB_HASH_MAP_KEY_U64,
+        // Keys are copied into the map's allocator
+        PB_HASH_MAP_KEY_STRING,
+};
+
+typedef struct _HashMapStringKey {
+        const char* data;
+        u64 length;
+        u64 hash;
+} HashMapStringKey;
+
+typedef struct _HashMap {
+        Allocator* allocator;
+        enum HashMapKeyType key_type;
+        // capacity + PB_HASH_MAP_GROUP_SIZE bytes, the first group is cloned at the end
+        u8* ctrl;
+        u8* slots;
+        u64 capacity;
+        u64 size;
+        u64 growth_left;
+        u64 key_size;
+        u64 value_size;
+        u64 slot_size;
+} HashMap;
+
+void pb_hash_map_init(HashMap* map, Allocator* allocator, enum HashMapKeyType key_type, u64 value_size, u64 capacity);
+void pb_hash_map_release(HashMap* map);
+void pb_hash_map_clear(HashMap* map);
+
+// get returns the value or NULL, put returns the value inserting a zeroed one if missing
+void* pb_hash_map_get_u64(HashMap* map, u64 key);
+void* pb_hash_map_put_u64(HashMap* map, u64 key);
+int pb_hash_map_remove_u64(HashMap* map, u64 key);
+void* pb_hash_map_get_string(HashMap* map, const char* key, u64 length);
+void* pb_hash_map_put_string(HashMap* map, const char* key, u64 length);
+int pb_hash_map_remove_string(HashMap* map, const char* key, u64 length);
+
+u64 pb_hash_u64(u64 key);
+u64 pb_hash_bytes(const void* data, u64 length);
+
+// Slot iteration: for (u64 i = pb_hash_map_next(map, 0); i < map->capacity; i = pb_hash_map_next(map, i + 1))
+u64 pb_hash_map_next(HashMap* map, u64 index);
+#define pb_hash_map_for_each(map, index) \
+        for (u64 index = pb_hash_map_next((map), 0); index < (map)->capacity; index = pb_hash_map_next((map), index + 1))
+#define pb_hash_map_key_u64(map, index) (*(u64*)((map)->slots + (index) * (map)->slot_size))
+#define pb_hash_map_key_string(map, index) ((HashMapStringKey*)((map)->slots + (index) * (map)->slot_size))
+#define pb_hash_map_value(map, index) ((void*)((map)->slots + (index) * (map)->slot_size + (map)->key_size))
+
+
+
 #endif  // PB_H
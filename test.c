@@ -1,48 +1,5 @@
 #include "pb.c"
 
-inline void no_optimize(void* value) {
-#if defined(__clang__)
-        asm volatile("" : "+r,m"(value) : : "memory");
-#else
-        asm volatile("" : "+m,r"(value) : : "memory");
-#endif
-}
-
-void benchmark_unaligned() {
-        u64 total_memory = 1024*1024*1024;
-        // mix aligned and unaligned
-        u64 blocks[] = {64, 65, 128, 129};
-
-        {
-                Arena arena = pb_arena_allocate(total_memory);
-                u64 block_index = 0;
-                u64 amount = 0;
-                u64 start = pb_cycles();
-                while(amount < total_memory) {
-                        void* p = pb_arena_push_no_zero(&arena, blocks[block_index]);
-                        no_optimize(p);
-                        amount += blocks[block_index];
-                }
-                u64 end = pb_cycles();
-                printf("%20s: %15llu\n", "Cycles arena", end - start);
-                pb_arena_release(&arena);
-        }
-
-        {
-                u64 block_index = 0;
-                u64 amount = 0;
-                u64 start = pb_cycles();
-                while(amount < total_memory) {
-                        void* p = malloc(blocks[block_index]);
-                        no_optimize(p);
-                        amount += blocks[block_index];
-
-                }
-                u64 end = pb_cycles();
-                printf("%20s: %15llu\n", "Cycles malloc", end - start);
-        }
-}
-
 #define PRINT_TEST_OK() printf("Test OK %s\n", __FUNCTION__)
 
 void test_arena() {
@@ -81,8 +38,626 @@ void test_array() {
         PRINT_TEST_OK();
 }
 
+void test_array_growth() {
+        // the only array in an arena grows in place, no copies left behind
+        Allocator arena_allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1024*1024*1024);
+        Arena* arena = pb_allocator_arena_get(&arena_allocator);
+        DynamicArray(u64) array;
+        pb_dynamic_array_init(array, &arena_allocator, 8);
+        u64* first = array;
+        for (u64 i = 0; i < 100000; i++) {
+                pb_dynamic_array_push(array, i);
+        }
+        pb_assert(array == first);
+        pb_assert(arena->pos == sizeof(DynamicArrayHeader) + pb_dynamic_array_capacity(array) * sizeof(u64));
+        pb_dynamic_array_shrink_to_fit(array);
+        pb_assert(arena->pos == sizeof(DynamicArrayHeader) + 100000 * sizeof(u64));
+
+        // another allocation on top forces a copy
+        DynamicArray(u64) other;
+        pb_dynamic_array_init(other, &arena_allocator, 8);
+        pb_dynamic_array_push(array, 100000);
+        pb_assert(array != first);
+        for (u64 i = 0; i <= 100000; i++) {
+                pb_assert(array[i] == i);
+        }
+
+        // system arrays past PB_SYS_MAP_THRESHOLD are mremapped
+        Allocator sys_allocator = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+        DynamicArray(u64) sys_array;
+        pb_dynamic_array_init(sys_array, &sys_allocator, 8);
+        for (u64 i = 0; i < 1000000; i++) {
+                pb_dynamic_array_push(sys_array, i);
+        }
+        pb_assert(pb_sys_header(pb_dynamic_array_header(sys_array))->mapped_size > 0);
+        u64 values[] = {7, 8, 9};
+        pb_dynamic_array_append(sys_array, values, 3);
+        pb_assert(pb_dynamic_array_size(sys_array) == 1000003);
+        pb_assert(pb_dynamic_array_pop(sys_array) == 9);
+        pb_dynamic_array_reserve(sys_array, 4000000);
+        pb_assert(pb_dynamic_array_capacity(sys_array) == 4000000);
+        pb_dynamic_array_shrink_to_fit(sys_array);
+        pb_assert(pb_dynamic_array_capacity(sys_array) == 1000002);
+        for (u64 i = 0; i < 1000000; i++) {
+                pb_assert(sys_array[i] == i);
+        }
+        pb_assert(sys_array[1000000] == 7 && sys_array[1000001] == 8);
+        pb_dynamic_array_release(sys_array, &sys_allocator);
+
+        // small system allocations honor the alignment
+        sys_allocator.set_auto_align(&sys_allocator, 256);
+        void* aligned = sys_allocator.allocate(&sys_allocator, 100);
+        pb_assert(((u64)aligned & 255) == 0);
+        sys_allocator.deallocate(&sys_allocator, aligned);
+
+        pb_arena_release(&arena_allocator);
+        PRINT_TEST_OK();
+}
+
+void test_arena_growable() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1024*1024*1024);
+        Arena* arena = pb_allocator_arena_get(&allocator);
+        pb_assert(arena->committed == 0);
+
+        u8* p1 = (u8*)allocator.allocate(&allocator, 10);
+        pb_assert(p1 == arena->memory);
+        pb_assert(arena->committed == PB_ARENA_COMMIT_SIZE);
+
+        u8* p2 = (u8*)pb_arena_push_no_zero(&allocator, 4*1024*1024);
+        pb_assert(p2 == p1 + 10);
+        pb_assert(arena->committed >= 10 + 4*1024*1024);
+        pb_memset(p2, 1, 4*1024*1024);
+
+        u8* p3 = (u8*)pb_arena_push_aligner(&allocator, 64);
+        pb_assert(((u64)p3 & 63) == 0);
+        pb_assert(p3 == (u8*)arena->memory + arena->pos);
+
+        // popping keeps at most decommit_threshold committed
+        pb_arena_pop(&allocator, p2);
+        pb_assert(arena->pos == 10);
+        pb_assert(arena->committed == PB_ARENA_DECOMMIT_THRESHOLD);
+
+        // decommitted pages come back zeroed
+        u8* p4 = (u8*)pb_arena_push_no_zero(&allocator, 4*1024*1024);
+        pb_assert(p4 == p2);
+        pb_assert(p4[4*1024*1024 - 1] == 0);
+
+        pb_arena_clear(&allocator);
+        pb_assert(arena->pos == 0);
+        pb_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void test_arena_temp() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1024*1024*1024);
+        Arena* arena = pb_allocator_arena_get(&allocator);
+        allocator.allocate(&allocator, 100);
+
+        ArenaTemp temp = pb_arena_temp_begin(&allocator);
+        allocator.allocate(&allocator, 1000);
+        pb_assert(arena->pos == 1100);
+        pb_arena_temp_end(temp);
+        pb_assert(arena->pos == 100);
+
+        pb_arena_temp_scope(&allocator) {
+                allocator.allocate(&allocator, 2*1024*1024);
+                pb_arena_temp_scope(&allocator) {
+                        allocator.allocate(&allocator, 10);
+                        pb_assert(arena->pos == 100 + 2*1024*1024 + 10);
+                }
+                pb_assert(arena->pos == 100 + 2*1024*1024);
+        }
+        pb_assert(arena->pos == 100);
+        pb_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void test_memset_memcpy() {
+        u8 source[512];
+        u8 destination[512];
+        u8 expected[512];
+        for (int i = 0; i < 512; i++) {
+                source[i] = (u8)(i * 7 + 3);
+        }
+        // The dispatched entry points are always tested, avx2 only where the cpu has it
+        void (*memset_kernels[])(void*, u8, u64) = {pb_memset, pb_memset_sse2, pb_memset_avx2};
+        void (*memcpy_kernels[])(void*, const void*, u64) = {pb_memcpy, pb_memcpy_sse2, pb_memcpy_avx2};
+        int kernels = __builtin_cpu_supports("avx2") ? 3 : 2;
+        for (int kernel = 0; kernel < kernels; kernel++) {
+                for (u64 offset = 0; offset < 33; offset++) {
+                        for (u64 size = 0; size < 300; size++) {
+                                pb_memset_bytes(destination, 0xaa, 512);
+                                pb_memset_bytes(expected, 0xaa, 512);
+                                pb_memset_bytes(expected + offset, 0x5c, size);
+                                memset_kernels[kernel](destination + offset, 0x5c, size);
+                                pb_assert(memcmp(destination, expected, 512) == 0);
+
+                                memcpy(expected + offset, source + 100, size);
+                                memcpy_kernels[kernel](destination + offset, source + 100, size);
+                                pb_assert(memcmp(destination, expected, 512) == 0);
+                        }
+                }
+        }
+        PRINT_TEST_OK();
+}
+
+void test_arena_push_zero() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1024*1024*1024);
+        Arena* arena = pb_allocator_arena_get(&allocator);
+        u8* p1 = (u8*)pb_arena_push_no_zero(&allocator, 1000);
+        pb_memset(p1, 0xff, 1000);
+        pb_assert(arena->dirty_end == 1000);
+
+        // reused memory is zeroed, fresh memory past dirty_end is left as mapped
+        pb_arena_pop_to(&allocator, 500);
+        u8* p2 = (u8*)allocator.allocate(&allocator, 1000);
+        for (int i = 0; i < 1000; i++) {
+                pb_assert(p2[i] == 0);
+        }
+        pb_assert(arena->dirty_end == 1500);
+        pb_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void test_pool() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+        u64 sizes[] = {1, 16, 17, 64, 100, 4096, 16384, 16385, 1024*1024};
+        void* pointers[9];
+        for (int i = 0; i < 9; i++) {
+                pointers[i] = allocator.allocate(&allocator, sizes[i]);
+                pb_assert(((u64)pointers[i] & 15) == 0);
+                pb_memset(pointers[i], (u8)i, sizes[i]);
+        }
+        for (int i = 0; i < 9; i++) {
+                pb_assert(((u8*)pointers[i])[sizes[i] - 1] == (u8)i);
+                allocator.deallocate(&allocator, pointers[i]);
+        }
+
+        // freed objects are reused first
+        void* p1 = allocator.allocate(&allocator, 40);
+        allocator.deallocate(&allocator, p1);
+        pb_assert(allocator.allocate(&allocator, 40) == p1);
+
+        allocator.set_auto_align(&allocator, 256);
+        for (int i = 0; i < 1000; i++) {
+                void* p = allocator.allocate(&allocator, 24);
+                pb_assert(((u64)p & 255) == 0);
+        }
+        void* large = allocator.allocate(&allocator, 100000);
+        pb_assert(((u64)large & 255) == 0);
+        allocator.deallocate(&allocator, large);
+        pb_pool_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void* test_pool_thread(void* ctx) {
+        Allocator* allocator = (Allocator*)ctx;
+        u64* live[100];
+        for (int round = 0; round < 1000; round++) {
+                for (u64 i = 0; i < 100; i++) {
+                        live[i] = (u64*)allocator->allocate(allocator, 8 + (i % 5) * 24);
+                        *live[i] = (u64)pthread_self() + i;
+                }
+                for (u64 i = 0; i < 100; i++) {
+                        pb_assert(*live[i] == (u64)pthread_self() + i);
+                        allocator->deallocate(allocator, live[i]);
+                }
+        }
+        return NULL;
+}
+
+void test_pool_threads() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+                pthread_create(&threads[i], NULL, test_pool_thread, &allocator);
+        }
+        for (int i = 0; i < 4; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pb_pool_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void* test_pool_exit_thread(void* ctx) {
+        Allocator* allocator = (Allocator*)ctx;
+        void** freed = (void**)allocator->allocate(allocator, 1024);
+        for (int i = 0; i < 10; i++) {
+                freed[i] = allocator->allocate(allocator, 48);
+        }
+        for (int i = 0; i < 10; i++) {
+                allocator->deallocate(allocator, freed[i]);
+        }
+        return freed;
+}
+
+static int test_pool_contains(void** pointers, int count, void* p) {
+        for (int i = 0; i < count; i++) {
+                if (pointers[i] == p) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+void test_pool_drain() {
+        // A pool sharing the thread cache slot evicts the first one's cache into its depots
+        Allocator first = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+        Allocator others[PB_POOL_MAX_POOLS];
+        for (int i = 0; i < PB_POOL_MAX_POOLS; i++) {
+                others[i] = pb_allocator_create(PB_ALLOCATOR_POOL, 0);
+        }
+        Allocator* second = &others[PB_POOL_MAX_POOLS - 1];
+        pb_assert(second->ctx.pool->id % PB_POOL_MAX_POOLS == first.ctx.pool->id % PB_POOL_MAX_POOLS);
+        void* freed[10];
+        for (int i = 0; i < 10; i++) {
+                freed[i] = first.allocate(&first, 48);
+        }
+        for (int i = 0; i < 10; i++) {
+                first.deallocate(&first, freed[i]);
+        }
+        second->deallocate(second, second->allocate(second, 48));
+        pb_assert(test_pool_contains(freed, 10, first.allocate(&first, 48)));
+
+        // Objects freed by an exiting thread go back to the depot
+        pthread_t thread;
+        void** exited;
+        pthread_create(&thread, NULL, test_pool_exit_thread, second);
+        pthread_join(thread, (void**)&exited);
+        pb_assert(test_pool_contains(exited, 10, second->allocate(second, 48)));
+
+        // Alignments up to half a slab still find the header of large blocks
+        second->set_auto_align(second, PB_POOL_SLAB_SIZE / 2);
+        void* large = second->allocate(second, 100000);
+        pb_assert(((u64)large & (PB_POOL_SLAB_SIZE / 2 - 1)) == 0);
+        second->deallocate(second, large);
+
+        pb_pool_release(&first);
+        for (int i = 0; i < PB_POOL_MAX_POOLS; i++) {
+                pb_pool_release(&others[i]);
+        }
+        PRINT_TEST_OK();
+}
+
+void* test_concurrent_arena_thread(void* ctx) {
+        Allocator* allocator = (Allocator*)ctx;
+        u64* blocks[1000];
+        for (u64 i = 0; i < 1000; i++) {
+                blocks[i] = (u64*)allocator->allocate(allocator, 8 + (i % 7) * 8);
+                pb_assert(((u64)blocks[i] & 7) == 0);
+                for (u64 j = 0; j < 1 + i % 7; j++) {
+                        blocks[i][j] = (u64)pthread_self() ^ i;
+                }
+        }
+        for (u64 i = 0; i < 1000; i++) {
+                for (u64 j = 0; j < 1 + i % 7; j++) {
+                        pb_assert(blocks[i][j] == ((u64)pthread_self() ^ i));
+                }
+        }
+        return NULL;
+}
+
+void test_concurrent_arena() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_CONCURRENT_ARENA, 1024*1024*1024);
+        ConcurrentArena* arena = allocator.ctx.concurrent_arena;
+        pthread_t threads[4];
+        for (int phase = 0; phase < 2; phase++) {
+                for (int i = 0; i < 4; i++) {
+                        pthread_create(&threads[i], NULL, test_concurrent_arena_thread, &allocator);
+                }
+                for (int i = 0; i < 4; i++) {
+                        pthread_join(threads[i], NULL);
+                }
+                pb_assert(arena->pos == 4 * PB_CONCURRENT_ARENA_CHUNK_SIZE);
+
+                // after a reset the calling thread starts over from the first chunk
+                void* p = allocator.allocate(&allocator, 10);
+                allocator.deallocate(&allocator, p);
+                pb_concurrent_arena_reset(&allocator);
+                pb_assert(allocator.allocate(&allocator, 10) == arena->memory);
+                pb_concurrent_arena_reset(&allocator);
+        }
+        pb_concurrent_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void* test_numa_arena_set_thread(void* ctx) {
+        Allocator* allocator = (Allocator*)ctx;
+        NumaArenaSet* set = allocator->ctx.numa_arena_set;
+        u64* p = (u64*)allocator->allocate(allocator, 64);
+        *p = 1;
+        // The thread may have moved since its node was looked up, so check against where the page is
+        int owner = -1;
+        for (u32 node = 0; node < set->node_count; node++) {
+                ConcurrentArena* arena = set->arenas[node].ctx.concurrent_arena;
+                if ((u8*)p >= (u8*)arena->memory && (u8*)p < (u8*)arena->memory + arena->capacity) {
+                        owner = (int)node;
+                }
+        }
+        pb_assert(owner >= 0);
+        int page_node = pb_numa_node_of(p);
+        pb_assert(page_node < 0 || page_node == owner);
+        return NULL;
+}
+
+void test_numa() {
+        u32 nodes = pb_numa_node_count();
+        pb_assert(nodes >= 1 && nodes <= PB_NUMA_MAX_NODES);
+        pb_assert(pb_numa_current_node() < nodes);
+
+        // Pages land on the bound node, unless the kernel has no NUMA and refused the mbind
+        u32 last = nodes - 1;
+        NumaPolicy bind = {PB_NUMA_BIND, last};
+        Allocator arena = pb_allocator_create_numa(PB_ALLOCATOR_ARENA, 1024 * 1024, bind);
+        u8* p = (u8*)arena.allocate(&arena, 4096);
+        p[0] = 1;
+        int bound = pb_numa_apply(arena.ctx.arena.memory, arena.ctx.arena.capacity, bind) == 0;
+        pb_assert(!bound || pb_numa_node_of(p) == (int)last);
+        pb_arena_release(&arena);
+
+        // With a policy even small system blocks are mapped
+        NumaPolicy interleave = {PB_NUMA_INTERLEAVE, 0};
+        Allocator sys = pb_allocator_create_numa(PB_ALLOCATOR_SYSTEM, 0, interleave);
+        u64* small = (u64*)sys.allocate(&sys, 32);
+        pb_assert(pb_sys_header(small)->mapped_size == 4096);
+        small[3] = 7;
+        small = (u64*)sys.reallocate(&sys, small, 32, 128 * 1024);
+        pb_assert(small[3] == 7);
+        sys.deallocate(&sys, small);
+
+        NumaPolicy local = {PB_NUMA_LOCAL, 0};
+        Allocator pool = pb_allocator_create_numa(PB_ALLOCATOR_POOL, 0, local);
+        pb_assert(pool.ctx.pool->numa.node == pb_numa_current_node());
+        u64* block = (u64*)pool.allocate(&pool, 64);
+        *block = 1;
+        pb_assert(!bound || pb_numa_node_of(block) == (int)pb_numa_current_node());
+        pool.deallocate(&pool, block);
+        pb_pool_release(&pool);
+
+        Allocator set = pb_allocator_create(PB_ALLOCATOR_NUMA_ARENA_SET, 64 * 1024 * 1024);
+        pb_assert(set.ctx.numa_arena_set->node_count == nodes);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+                pthread_create(&threads[i], NULL, test_numa_arena_set_thread, &set);
+        }
+        for (int i = 0; i < 4; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pb_numa_arena_set_reset(&set);
+        pb_numa_arena_set_release(&set);
+        PRINT_TEST_OK();
+}
+
+void test_static_dispatch() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA, 1024*1024);
+        Arena* arena = pb_allocator_arena_get(&allocator);
+
+        u64* p1 = pb_push_array(arena, u64, 4);
+        pb_assert((void*)p1 == arena->memory);
+        pb_assert(arena->pos == 32);
+        u64* p2 = pb_push_struct(&allocator, u64);
+        pb_assert(p2 == p1 + 4);
+        pb_deallocate(arena, p2);
+        pb_deallocate(&allocator, p2);
+
+        // both paths zero memory reused after a pop
+        pb_memset(p1, 0xff, 40);
+        pb_arena_clear(&allocator);
+        u64* p3 = (u64*)pb_allocate(arena, 16);
+        u64* p4 = (u64*)pb_allocate(&allocator, 24);
+        pb_assert(p3[0] == 0 && p3[1] == 0);
+        pb_assert(p4[0] == 0 && p4[1] == 0 && p4[2] == 0);
+        pb_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+void test_hash_map_u64() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+        HashMap map;
+        pb_hash_map_init(&map, &allocator, PB_HASH_MAP_KEY_U64, sizeof(u64), 0);
+        for (u64 i = 0; i < 100000; i++) {
+                u64* value = (u64*)pb_hash_map_put_u64(&map, i * 7919);
+                pb_assert(*value == 0);
+                *value = i;
+        }
+        pb_assert(map.size == 100000);
+        for (u64 i = 0; i < 100000; i++) {
+                u64* value = (u64*)pb_hash_map_get_u64(&map, i * 7919);
+                pb_assert(value != NULL && *value == i);
+        }
+        pb_assert(pb_hash_map_get_u64(&map, 1) == NULL);
+
+        for (u64 i = 0; i < 100000; i += 2) {
+                pb_assert(pb_hash_map_remove_u64(&map, i * 7919));
+        }
+        pb_assert(!pb_hash_map_remove_u64(&map, 0));
+        pb_assert(map.size == 50000);
+
+        u64 count = 0;
+        pb_hash_map_for_each(&map, i) {
+                u64 key = pb_hash_map_key_u64(&map, i);
+                u64 value = *(u64*)pb_hash_map_value(&map, i);
+                pb_assert(key == value * 7919 && value % 2 == 1);
+                count++;
+        }
+        pb_assert(count == 50000);
+
+        // tombstones get reused and rehashed away
+        for (u64 round = 0; round < 10; round++) {
+                for (u64 i = 0; i < 100000; i += 2) {
+                        *(u64*)pb_hash_map_put_u64(&map, i * 7919) = i;
+                }
+                for (u64 i = 0; i < 100000; i += 2) {
+                        pb_assert(pb_hash_map_remove_u64(&map, i * 7919));
+                }
+        }
+        pb_assert(map.size == 50000);
+        for (u64 i = 1; i < 100000; i += 2) {
+                pb_assert(*(u64*)pb_hash_map_get_u64(&map, i * 7919) == i);
+        }
+        pb_hash_map_release(&map);
+        PRINT_TEST_OK();
+}
+
+void test_hash_map_string() {
+        Allocator allocator = pb_allocator_create(PB_ALLOCATOR_ARENA_GROWABLE, 1024*1024*1024);
+        HashMap map;
+        pb_hash_map_init(&map, &allocator, PB_HASH_MAP_KEY_STRING, sizeof(u32), 16);
+        char key[64];
+        for (u32 i = 0; i < 10000; i++) {
+                int length = sprintf(key, "queue_transactions_%u", i);
+                *(u32*)pb_hash_map_put_string(&map, key, length) = i;
+        }
+        for (u32 i = 0; i < 10000; i++) {
+                int length = sprintf(key, "queue_transactions_%u", i);
+                u32* value = (u32*)pb_hash_map_get_string(&map, key, length);
+                pb_assert(value != NULL && *value == i);
+        }
+        pb_assert(pb_hash_map_get_string(&map, "queue_transactions_", 19) == NULL);
+        pb_assert(pb_hash_map_remove_string(&map, "queue_transactions_5", 20));
+        pb_assert(pb_hash_map_get_string(&map, "queue_transactions_5", 20) == NULL);
+
+        // keys are owned by the map
+        pb_hash_map_for_each(&map, i) {
+                HashMapStringKey* string_key = pb_hash_map_key_string(&map, i);
+                pb_assert(string_key->data[string_key->length] == 0);
+                pb_assert(string_key->data != key);
+        }
+        pb_assert(map.size == 9999);
+        pb_hash_map_release(&map);
+        pb_arena_release(&allocator);
+        PRINT_TEST_OK();
+}
+
+// The asm keeps the calls from becoming tail calls, each helper is its own site
+static __attribute__((noinline)) void* test_tracking_site_a(Allocator* allocator, u64 size) {
+        void* memory = allocator->allocate(allocator, size);
+        __asm__ volatile("");
+        return memory;
+}
+
+static __attribute__((noinline)) void* test_tracking_site_b(Allocator* allocator, u64 size) {
+        void* memory = allocator->allocate(allocator, size);
+        __asm__ volatile("");
+        return memory;
+}
+
+static u64 test_tracking_events[2];
+
+static void test_tracking_hook(void* ctx, u64 site, u64 size, u64 lifetime, int freed) {
+        pb_assert(ctx == test_tracking_events);
+        pb_assert(site != 0);
+        test_tracking_events[freed]++;
+}
+
+static void* test_tracking_thread(void* ctx) {
+        Allocator* allocator = (Allocator*)ctx;
+        for (int i = 0; i < 10000; i++) {
+                void* memory = test_tracking_site_a(allocator, 100);
+                allocator->deallocate(allocator, memory);
+        }
+        return NULL;
+}
+
+void test_tracking_allocator() {
+        Allocator system = pb_allocator_create(PB_ALLOCATOR_SYSTEM, 0);
+        Allocator allocator = pb_tracking_allocator_create(&system);
+        TrackingAllocator* tracking = allocator.ctx.tracking;
+        pb_tracking_set_hook(&allocator, test_tracking_hook, test_tracking_events);
+
+        void* pointers[10];
+        for (int i = 0; i < 10; i++) {
+                pointers[i] = test_tracking_site_a(&allocator, 100);
+                pb_assert((u64)pointers[i] % 16 == 0);
+                memset(pointers[i], 0xab, 100);
+        }
+        for (int i = 0; i < 5; i++) {
+                allocator.deallocate(&allocator, pointers[i]);
+        }
+        u8* big = (u8*)test_tracking_site_b(&allocator, 5000);
+        big[4999] = 1;
+        big = (u8*)allocator.reallocate(&allocator, big, 5000, 100000);
+        pb_assert(big[4999] == 1);
+
+        pb_tracking_flush(&allocator);
+        TrackingSite* site_a = NULL;
+        TrackingSite* site_b = NULL;
+        u64 site_count = 0;
+        for (u64 i = 0; i < PB_TRACKING_MAX_SITES; i++) {
+                TrackingSite* site = &tracking->sites[i];
+                if (site->address == 0) {
+                        continue;
+                }
+                site_count++;
+                if (site->allocations == 10) {
+                        site_a = site;
+                } else {
+                        site_b = site;
+                }
+        }
+        pb_assert(site_count == 2 && site_a != NULL && site_b != NULL);
+        pb_assert(pb_tracking_site_get(&allocator, site_a->address) == site_a);
+        pb_assert(pb_tracking_site_get(&allocator, 1) == NULL);
+        pb_assert(site_a->frees == 5);
+        pb_assert(site_a->bytes == 1000);
+        pb_assert(site_a->live_bytes == 500);
+        // peaks are sampled when the thread deltas are flushed
+        pb_assert(site_a->peak_bytes >= 500 && site_a->peak_bytes <= 1000);
+        pb_assert(site_a->histogram[6] == 10);
+        pb_assert(site_b->allocations == 1);
+        pb_assert(site_b->live_bytes == 100000);
+        pb_assert(site_b->peak_bytes == 100000);
+        pb_assert(site_b->histogram[12] == 1);
+        pb_assert(tracking->live_bytes == 100500);
+        pb_assert(tracking->peak_bytes >= 100500 && tracking->peak_bytes <= 101000);
+        pb_assert(test_tracking_events[0] == 11 && test_tracking_events[1] == 5);
+
+        // exiting threads flush their pending deltas
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+                pthread_create(&threads[i], NULL, test_tracking_thread, &allocator);
+        }
+        for (int i = 0; i < 4; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        pb_assert(site_a->allocations == 40010 && site_a->frees == 40005);
+        pb_assert(site_a->live_bytes == 500);
+
+        for (int i = 5; i < 10; i++) {
+                allocator.deallocate(&allocator, pointers[i]);
+        }
+        allocator.deallocate(&allocator, big);
+        pb_tracking_flush(&allocator);
+        pb_assert(tracking->live_bytes == 0);
+        pb_assert(site_a->live_bytes == 0 && site_b->live_bytes == 0);
+
+        allocator.set_auto_align(&allocator, 64);
+        void* aligned = test_tracking_site_a(&allocator, 10);
+        pb_assert((u64)aligned % 64 == 0);
+        allocator.deallocate(&allocator, aligned);
+
+        FILE* null_file = fopen("/dev/null", "w");
+        pb_tracking_report(&allocator, null_file);
+        fclose(null_file);
+        pb_tracking_allocator_release(&allocator);
+        PRINT_TEST_OK();
+}
+
 int main() {
         test_arena();
         test_array();
-        // benchmark_unaligned();
+        test_array_growth();
+        test_arena_growable();
+        test_arena_temp();
+        test_memset_memcpy();
+        test_arena_push_zero();
+        test_pool();
+        test_pool_threads();
+        test_pool_drain();
+        test_concurrent_arena();
+        test_numa();
+        test_static_dispatch();
+        test_hash_map_u64();
+        test_hash_map_string();
+        test_tracking_allocator();
 }
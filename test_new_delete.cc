@@ -0,0 +1,46 @@
+// Global operator new/delete through the tracking allocator, C++ only so it
+// can't live in test.c
+#define PB_TRACKING_NEW_DELETE
+#include "pb.c"
+#include <string>
+#include <dlfcn.h>
+
+#define PRINT_TEST_OK() printf("Test OK %s\n", __FUNCTION__)
+
+// Built with -rdynamic so dladdr names the site
+__attribute__((noinline)) void test_new_site_allocate(std::string** result) {
+        *result = new std::string("short");
+}
+
+void test_new_delete_site() {
+        Allocator* allocator = pb_tracking_new_delete_allocator();
+        std::string* strings[10];
+        for (int i = 0; i < 10; i++) {
+                test_new_site_allocate(&strings[i]);
+        }
+        pb_tracking_flush(allocator);
+        TrackingAllocator* tracking = allocator->ctx.tracking;
+        TrackingSite* found = NULL;
+        for (u64 i = 0; i < PB_TRACKING_MAX_SITES; i++) {
+                TrackingSite* site = &tracking->sites[i];
+                Dl_info info;
+                if (site->address != 0 && dladdr((void*)site->address, &info) != 0 && info.dli_sname != NULL &&
+                    strstr(info.dli_sname, "test_new_site_allocate") != NULL) {
+                        pb_assert(found == NULL);
+                        found = site;
+                }
+        }
+        // operator new inlined into its caller reports the caller's caller instead
+        pb_assert(found != NULL);
+        pb_assert(found->allocations == 10);
+        for (int i = 0; i < 10; i++) {
+                delete strings[i];
+        }
+        pb_tracking_flush(allocator);
+        pb_assert(found->frees == 10 && found->live_bytes == 0);
+        PRINT_TEST_OK();
+}
+
+int main() {
+        test_new_delete_site();
+}
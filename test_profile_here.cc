@@ -0,0 +1,108 @@
+// PbProfileHere anchors keyed by their own call sites. Built with -no-pie so
+// the recorded addresses go straight to addr2line.
+#include "pb.c"
+#include "time_function.h"
+#include <string>
+#include <vector>
+
+#define PRINT_TEST_OK() printf("Test OK %s\n", __FUNCTION__)
+
+static int test_here_line_a = 0;
+static int test_here_line_b = 0;
+static int test_pc_line_a = 0;
+static int test_pc_line_b = 0;
+static int test_pc_line_c = 0;
+static int test_pc_line_d = 0;
+
+__attribute__((noinline)) int test_here_a(int x) {
+        PbProfileHere(scope); test_here_line_a = __LINE__;
+        return x + 1;
+}
+
+__attribute__((noinline)) int test_here_b(int x) {
+        PbProfileHere(scope); test_here_line_b = __LINE__;
+        return x * 2;
+}
+
+// The capture PbProfileHere and PbProfileLockGuard use, testable without perf
+__attribute__((noinline)) uint64_t test_pc_a() {
+        uint64_t pc = pb_profiler::pb_profile_current_pc(); test_pc_line_a = __LINE__;
+        return pc;
+}
+
+__attribute__((noinline)) uint64_t test_pc_b() {
+        uint64_t pc = pb_profiler::pb_profile_current_pc(); test_pc_line_b = __LINE__;
+        return pc;
+}
+
+// Two sites in one function, as sites inlined into one caller end up
+__attribute__((noinline)) void test_pc_c_d(uint64_t* c, uint64_t* d) {
+        *c = pb_profiler::pb_profile_current_pc(); test_pc_line_c = __LINE__;
+        *d = pb_profiler::pb_profile_current_pc(); test_pc_line_d = __LINE__;
+}
+
+// "file:line" of the innermost frame of address
+static std::string test_here_location(uint64_t address) {
+        char command[256];
+        snprintf(command, sizeof(command), "addr2line -i -e /proc/%d/exe %#lx", getpid(), address);
+        FILE* pipe = popen(command, "r");
+        pb_assert(pipe != NULL);
+        char line[4096] = {0};
+        pb_assert(fgets(line, sizeof(line), pipe) != NULL);
+        pclose(pipe);
+        std::string location(line);
+        location = location.substr(0, location.find_first_of(" \n"));
+        return location.substr(location.rfind('/') + 1);
+}
+
+void test_current_pc_sites() {
+        uint64_t a = test_pc_a();
+        uint64_t b = test_pc_b();
+        pb_assert(a != b);
+        pb_assert(test_here_location(a) == "test_profile_here.cc:" + std::to_string(test_pc_line_a));
+        pb_assert(test_here_location(b) == "test_profile_here.cc:" + std::to_string(test_pc_line_b));
+        uint64_t c, d;
+        test_pc_c_d(&c, &d);
+        pb_assert(c != d);
+        pb_assert(test_here_location(c) == "test_profile_here.cc:" + std::to_string(test_pc_line_c));
+        pb_assert(test_here_location(d) == "test_profile_here.cc:" + std::to_string(test_pc_line_d));
+        PRINT_TEST_OK();
+}
+
+void test_profile_here_sites() {
+        // Without perf the counters read 0 from a zero page instead of exiting, only the sites matter here
+        static pb_profiler::perf_event_mmap_page zero_page;
+        for (int i = 0; i <= pb_profiler::PB_PERF_BRANCH_MISS; i++) {
+                pb_profiler::pb_profile_perf_event& event = pb_profiler::pb_profile_perf_events[i];
+                if (!event.initailized && !pb_profiler::pb_perf_event_try_open((pb_profiler::pb_perf_event_type)i)) {
+                        event.initailized = 1;
+                        event.fd = -1;
+                        event.mmap = &zero_page;
+                }
+        }
+        pb_profiler::PbProfilerStart profiler("test_profile_here.log");
+        test_here_a(1);
+        test_here_b(1);
+        std::vector<uint64_t> addresses;
+        for (uint64_t i = 0; i < PROFILE_MAX_ANCHORS; i++) {
+                if (pb_profiler::g_profiler.anchors[i].address != 0) {
+                        addresses.push_back(pb_profiler::g_profiler.anchors[i].address);
+                }
+        }
+        // two anchors, each at the line of its own PbProfileHere
+        pb_assert(addresses.size() == 2 && addresses[0] != addresses[1]);
+        std::string a = "test_profile_here.cc:" + std::to_string(test_here_line_a);
+        std::string b = "test_profile_here.cc:" + std::to_string(test_here_line_b);
+        std::string first = test_here_location(addresses[0]);
+        std::string second = test_here_location(addresses[1]);
+        pb_assert((first == a && second == b) || (first == b && second == a));
+        char log[64];
+        snprintf(log, sizeof(log), "%d-test_profile_here.log", getpid());
+        unlink(log);
+        PRINT_TEST_OK();
+}
+
+int main() {
+        test_current_pc_sites();
+        test_profile_here_sites();
+}
@@ -6,15 +6,22 @@
 #include <bits/types/FILE.h>
 #include <cstring>
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <execinfo.h>
 #include <asm/unistd.h>
 #include <x86intrin.h>
 #ifdef __cplusplus
 #include <atomic>
+#include <mutex>
+#include <type_traits>
     typedef std::atomic<uint64_t> atomic_uint64_t;
 #else
 #include <stdatomic.h>
@@ -30,16 +37,31 @@ namespace pb_profiler {
 #define PROFILE_TO_STDOUT 1
 #define PROFILE_MAX_THREADS 64
 #define PROFILE_MAX_ANCHORS 128
+#define PROFILE_CACHE_LINE_SIZE 64
+#define PROFILE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define PROFILE_THREAD_BUFFER_SIZE (1024 * 1024 * 20)
+// Per anchor and thread ring in flight recorder mode, 65536 records
+#define PROFILE_FLIGHT_RING_SIZE (1024 * 1024)
+// Prefaulted buffers kept ready for anchors used for the first time on a thread,
+// refilled by the profiler thread every PROFILE_BUFFER_POOL_REFILL_MS
+#define PROFILE_BUFFER_POOL_SIZE 4
+#define PROFILE_BUFFER_POOL_REFILL_MS 10
+// Slowest scopes kept per anchor and thread, and return addresses captured with PB_PROFILE_STACK
+#define PROFILE_EXEMPLARS 8
+#define PROFILE_EXEMPLAR_FRAMES 8
+// __COUNTER__ + 1 never hands out anchor 0, allocation and lock events are recorded there
+#define PROFILE_EVENT_ANCHOR 0
 
 
-    struct ArenaRegion {
+    // Headers are cache line aligned so buffers of different threads never share a line
+    struct alignas(PROFILE_CACHE_LINE_SIZE) ArenaRegion {
         void* start;
         void* end;
         void* current;
         ArenaRegion* next;
     };
 
-    struct Arena {
+    struct alignas(PROFILE_CACHE_LINE_SIZE) Arena {
         ArenaRegion* regions;
         ArenaRegion* current_region;
         bool growable;
@@ -52,7 +74,45 @@ namespace pb_profiler {
         PB_PROFILE_ANCHOR_CPU_MIGRATIONS = 2,
         PB_PROFILE_ANCHOR_CACHE_MISSES = 3,
         PB_PROFILE_ANCHOR_BRANCH_MISSES = 4,
-        PB_PROFILE_ANCHOR_LAST = 5,
+        PB_PROFILE_ANCHOR_PAGE_FAULTS = 5,
+        // Allocation events: a site record followed by the bytes or the lifetime in cycles
+        PB_PROFILE_ANCHOR_ALLOC_SITE = 6,
+        PB_PROFILE_ANCHOR_ALLOC_BYTES = 7,
+        PB_PROFILE_ANCHOR_ALLOC_LIFETIME = 8,
+        // rdtsc at the end of a scope, precedes the records of that scope
+        PB_PROFILE_ANCHOR_TIMESTAMP = 9,
+        // CPU the scope ended on, follows the timestamp with PB_PROFILE_CPU
+        PB_PROFILE_ANCHOR_CPU = 10,
+        // tsc ticks of the scope, stats converts them to ns with the header time parameters
+        PB_PROFILE_ANCHOR_TSC = 11,
+        // Lock events: the acquire site, then the wait (0 when uncontended) and hold tsc ticks
+        PB_PROFILE_ANCHOR_LOCK_SITE = 12,
+        PB_PROFILE_ANCHOR_LOCK_WAIT = 13,
+        PB_PROFILE_ANCHOR_LOCK_HOLD = 14,
+        // Payload a scope processed, set with PbProfile::add_bytes/add_items, last records of the scope
+        PB_PROFILE_ANCHOR_BYTES = 15,
+        PB_PROFILE_ANCHOR_ITEMS = 16,
+        // Instrumented calls (time_function_instrument.cc): the function address, then inclusive and self tsc ticks
+        PB_PROFILE_ANCHOR_FUNCTION_SITE = 17,
+        PB_PROFILE_ANCHOR_FUNCTION_TSC = 18,
+        PB_PROFILE_ANCHOR_FUNCTION_SELF_TSC = 19,
+        // Opens an exemplar with its end timestamp, its records and return addresses follow.
+        // Exemplars come in blocks of their own, written when the log is closed or dumped.
+        PB_PROFILE_ANCHOR_EXEMPLAR = 20,
+        PB_PROFILE_ANCHOR_EXEMPLAR_FRAME = 21,
+        PB_PROFILE_ANCHOR_LAST = 22,
+    };
+
+    enum PbProfileFlags {
+        PB_PROFILE_CACHE = 1,
+        PB_PROFILE_PAGE_FAULTS = 2,
+        PB_PROFILE_INSTRUCTIONS = 4,
+        PB_PROFILE_CYCLES = 8,
+        PB_PROFILE_BRANCH = 16,
+        // tags each sample with the CPU it ended on (rdtscp)
+        PB_PROFILE_CPU = 32,
+        // captures the return addresses of scopes kept as exemplars
+        PB_PROFILE_STACK = 64,
     };
 
     struct pb_profile_anchor_result {
@@ -60,16 +120,65 @@ namespace pb_profiler {
         uint64_t value;
     };
 
+    // The log starts with this header and maps_length bytes of /proc/self/maps
+    // so stats can symbolize address anchors offline, then come the flushed blocks
+#define PROFILE_LOG_MAGIC 0x31676f6c666f7270ULL  // "proflog1"
+#define PROFILE_LOG_VERSION 3
+    struct pb_profile_log_header {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t pid;
+        // Timestamp records are tsc ticks, tsc_hz is calibrated when the log is opened
+        uint64_t tsc_start;
+        uint64_t tsc_hz;
+        // perf_event_mmap_page tsc to ns conversion, ns = time_zero + (tsc * time_mult) >> time_shift,
+        // only valid with cap_user_time, tsc_hz is used otherwise
+        uint64_t time_zero;
+        uint32_t time_mult;
+        uint16_t time_shift;
+        uint16_t cap_user_time;
+        uint64_t maps_length;
+    };
+
     struct pb_profile_flush_header {
         uint64_t thread_id;
         uint64_t name_length;
         uint64_t result_amount;
+        // Code address of address anchors, their name_length is 0
+        uint64_t address;
+    };
+
+    // A whole scope, kept when it is among the slowest of its anchor and thread
+    struct pb_profile_exemplar {
+        uint64_t timestamp;
+        uint64_t flags;
+        uint64_t cpu;
+        uint64_t cycles;
+        uint64_t tsc;
+        uint64_t cache_misses;
+        uint64_t branch_misses;
+        uint64_t page_faults;
+        uint64_t bytes;
+        uint64_t items;
+        uint64_t frame_count;
+        uint64_t frames[PROFILE_EXEMPLAR_FRAMES];
+    };
+
+    struct alignas(PROFILE_CACHE_LINE_SIZE) pb_profile_anchor_thread {
+        pthread_mutex_t mutex;
+        Arena* results_arena;
+        // Flight recorder ring went around, records after current are the oldest
+        bool wrapped;
+        // Min-heap on cycles of PROFILE_EXEMPLARS, allocated on the first scope
+        pb_profile_exemplar* exemplars;
+        uint64_t exemplar_count;
     };
 
+    // Anchors are keyed by name or, with a NULL name, by address
     struct pb_profile_anchor {
         const char* name;
-        pthread_mutex_t mutex[PROFILE_MAX_THREADS];
-        Arena* anchor_results_arena[PROFILE_MAX_THREADS];
+        uint64_t address;
+        pb_profile_anchor_thread threads[PROFILE_MAX_THREADS];
     };
 
 
@@ -90,6 +199,15 @@ namespace pb_profiler {
 
     static thread_local pb_profile_perf_event pb_profile_perf_events[1024] = {{0}};
 
+    enum pb_profiler_mode {
+        // Thread buffers are written to the log whenever they fill up
+        PB_PROFILER_FLUSH = 0,
+        // Thread buffers are rings, nothing is written until a dump
+        PB_PROFILER_FLIGHT_RECORDER = 1,
+    };
+
+#define PROFILE_FATAL_SIGNAL_COUNT 5
+
     struct pb_profiler_t {
         pb_profile_anchor* anchors;
         uint64_t anchor_count;
@@ -99,6 +217,24 @@ namespace pb_profiler {
         FILE* pb_profile_file;
         pthread_mutex_t pb_file_mutex;
         pthread_t pb_profile_thread;
+        uint64_t tsc_start;
+        uint64_t tsc_hz;
+        uint64_t time_zero;
+        uint32_t time_mult;
+        uint16_t time_shift;
+        uint16_t cap_user_time;
+        pb_profiler_mode mode;
+        uint64_t ring_size;
+        // Slots are taken and refilled with atomic exchanges, NULL when empty
+        Arena* buffer_pool[PROFILE_BUFFER_POOL_SIZE];
+        // Header and maps from start, fatal signal dumps can't build a new one
+        char* log_header;
+        uint64_t log_header_length;
+        char dump_prefix[1024];
+        uint64_t dump_count;
+        // Posted by SIGUSR2, the profiler thread does the dump
+        sem_t dump_request;
+        struct sigaction old_actions[PROFILE_FATAL_SIGNAL_COUNT + 1];
     };
 
     extern pb_profiler_t g_profiler;
@@ -116,12 +252,45 @@ namespace pb_profiler {
     static inline uint64_t arena_region_size(ArenaRegion* region) {
         return (uintptr_t)region->end - (uintptr_t)region->start;
     }
-    static inline ArenaRegion* arena_region_create(size_t size) {
-        void* start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // Map a buffer backed by huge pages when possible and fault every page in
+    // now, so the first write to a page never happens inside a profiled scope.
+    static inline void* arena_region_map(size_t size) {
+        void* start = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (size % PROFILE_HUGE_PAGE_SIZE == 0) {
+            // Explicit huge pages, fails if the hugetlb pool is empty
+            start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            if (start != MAP_FAILED) {
+                return start;
+            }
+        }
+#endif
+        start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if (start == MAP_FAILED) {
             return NULL;
         }
-        ArenaRegion* arena_region = (ArenaRegion*)malloc(sizeof(ArenaRegion));
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages, must be requested before the pages are populated
+        madvise(start, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(start, size, MADV_POPULATE_WRITE) == 0) {
+            return start;
+        }
+#endif
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        for (uint64_t offset = 0; offset < size; offset += page_size) {
+            ((volatile char*)start)[offset] = 0;
+        }
+        return start;
+    }
+
+    static inline ArenaRegion* arena_region_create(size_t size) {
+        void* start = arena_region_map(size);
+        if (start == NULL) {
+            return NULL;
+        }
+        ArenaRegion* arena_region = (ArenaRegion*)aligned_alloc(PROFILE_CACHE_LINE_SIZE, sizeof(ArenaRegion));
         arena_region->start = start;
         arena_region->end = (void*)((uintptr_t)start + size);
         arena_region->current = start;
@@ -135,12 +304,11 @@ namespace pb_profiler {
     }
 
     static inline Arena* arena_create(size_t size, bool growable) {
-        void* start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (start == MAP_FAILED) {
+        ArenaRegion* arena_region = arena_region_create(size);
+        if (arena_region == NULL) {
             return NULL;
         }
-        ArenaRegion* arena_region = arena_region_create(size);
-        Arena* arena = (Arena*)malloc(sizeof(Arena));
+        Arena* arena = (Arena*)aligned_alloc(PROFILE_CACHE_LINE_SIZE, sizeof(Arena));
 
         arena->growable = growable;
         arena->regions = arena_region;
@@ -185,11 +353,131 @@ namespace pb_profiler {
         free(arena);
     }
 
+    static inline uint64_t pb_profile_buffer_size() {
+        return g_profiler.mode == PB_PROFILER_FLIGHT_RECORDER ? g_profiler.ring_size : PROFILE_THREAD_BUFFER_SIZE;
+    }
+
+    static inline Arena* pb_profile_buffer_create() {
+        Arena* arena = arena_create(pb_profile_buffer_size(), false);
+        if (arena == NULL) {
+            printf("Error: arena_create thread buffer failed\n");
+            exit(EXIT_FAILURE);
+        }
+        return arena;
+    }
+
+    // Runs at start and on the profiler thread, never inside a profiled scope
+    static inline void pb_profile_buffer_pool_refill() {
+        for (uint64_t i = 0; i < PROFILE_BUFFER_POOL_SIZE; i++) {
+            if (__atomic_load_n(&g_profiler.buffer_pool[i], __ATOMIC_ACQUIRE) == NULL) {
+                __atomic_store_n(&g_profiler.buffer_pool[i], pb_profile_buffer_create(), __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    // First use of an anchor on a thread takes a prefaulted buffer, only when more
+    // first uses than PROFILE_BUFFER_POOL_SIZE land between two refills is one built here
+    static inline Arena* pb_profile_buffer_take() {
+        for (uint64_t i = 0; i < PROFILE_BUFFER_POOL_SIZE; i++) {
+            Arena* arena = __atomic_exchange_n(&g_profiler.buffer_pool[i], (Arena*)NULL, __ATOMIC_ACQ_REL);
+            if (arena != NULL) {
+                return arena;
+            }
+        }
+        return pb_profile_buffer_create();
+    }
+
+    // Racy outside the lock, only used to skip the stack capture of scopes that won't be kept
+    static inline bool pb_profile_exemplar_wanted(pb_profile_anchor_thread& anchor_thread, uint64_t cycles) {
+        return anchor_thread.exemplars == NULL || anchor_thread.exemplar_count < PROFILE_EXEMPLARS ||
+               cycles > anchor_thread.exemplars[0].cycles;
+    }
+
+    static inline void pb_profile_exemplar_offer_locked(pb_profile_anchor_thread& anchor_thread, const pb_profile_exemplar& exemplar) {
+        if (anchor_thread.exemplars == NULL) {
+            anchor_thread.exemplars = (pb_profile_exemplar*)malloc(sizeof(pb_profile_exemplar) * PROFILE_EXEMPLARS);
+            anchor_thread.exemplar_count = 0;
+        }
+        pb_profile_exemplar* heap = anchor_thread.exemplars;
+        uint64_t i;
+        if (anchor_thread.exemplar_count < PROFILE_EXEMPLARS) {
+            i = anchor_thread.exemplar_count++;
+            while (i > 0 && heap[(i - 1) / 2].cycles > exemplar.cycles) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            heap[i] = exemplar;
+            return;
+        }
+        if (exemplar.cycles <= heap[0].cycles) {
+            return;
+        }
+        i = 0;
+        while (true) {
+            uint64_t child = 2 * i + 1;
+            if (child >= PROFILE_EXEMPLARS) {
+                break;
+            }
+            if (child + 1 < PROFILE_EXEMPLARS && heap[child + 1].cycles < heap[child].cycles) {
+                child++;
+            }
+            if (heap[child].cycles >= exemplar.cycles) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = exemplar;
+    }
+
+#define PROFILE_EXEMPLAR_MAX_RECORDS (PROFILE_EXEMPLARS * (9 + PROFILE_EXEMPLAR_FRAMES))
+
+    // The exemplar block of an anchor and thread, no allocation so dumps from signals can use it
+    static inline uint64_t pb_profile_exemplar_records(pb_profile_anchor_thread& anchor_thread, pb_profile_anchor_result* records) {
+        uint64_t count = 0;
+        auto add = [&](pb_profile_anchor_result_type type, uint64_t value) {
+            records[count].type = type;
+            records[count].value = value;
+            count++;
+        };
+        for (uint64_t i = 0; anchor_thread.exemplars != NULL && i < anchor_thread.exemplar_count; i++) {
+            pb_profile_exemplar& exemplar = anchor_thread.exemplars[i];
+            add(PB_PROFILE_ANCHOR_EXEMPLAR, exemplar.timestamp);
+            if (exemplar.flags & PB_PROFILE_CPU) {
+                add(PB_PROFILE_ANCHOR_CPU, exemplar.cpu);
+            }
+            add(PB_PROFILE_ANCHOR_CYCLES, exemplar.cycles);
+            add(PB_PROFILE_ANCHOR_TSC, exemplar.tsc);
+            if (exemplar.flags & PB_PROFILE_CACHE) {
+                add(PB_PROFILE_ANCHOR_CACHE_MISSES, exemplar.cache_misses);
+            }
+            if (exemplar.flags & PB_PROFILE_BRANCH) {
+                add(PB_PROFILE_ANCHOR_BRANCH_MISSES, exemplar.branch_misses);
+            }
+            if (exemplar.flags & PB_PROFILE_PAGE_FAULTS) {
+                add(PB_PROFILE_ANCHOR_PAGE_FAULTS, exemplar.page_faults);
+            }
+            if (exemplar.bytes > 0) {
+                add(PB_PROFILE_ANCHOR_BYTES, exemplar.bytes);
+            }
+            if (exemplar.items > 0) {
+                add(PB_PROFILE_ANCHOR_ITEMS, exemplar.items);
+            }
+            for (uint64_t j = 0; j < exemplar.frame_count; j++) {
+                add(PB_PROFILE_ANCHOR_EXEMPLAR_FRAME, exemplar.frames[j]);
+            }
+        }
+        return count;
+    }
+
     static inline void pb_profile_anchor_thread_flush(pb_profile_anchor* anchor, uint64_t thread_id) {
+        Arena* arena = anchor->threads[thread_id].results_arena;
+        if (arena == NULL) {
+            return;
+        }
         pthread_mutex_lock(&g_profiler.pb_file_mutex);
-        Arena* arena = anchor->anchor_results_arena[thread_id];
         //assert mutex is locked
-        PROFILE_ASSERT(pthread_mutex_trylock(&anchor->mutex[thread_id]) == EBUSY);
+        PROFILE_ASSERT(pthread_mutex_trylock(&anchor->threads[thread_id].mutex) == EBUSY);
         PROFILE_ASSERT(arena->growable == false);
         FILE* log_file = g_profiler.pb_profile_file;
         uint64_t amount = (uintptr_t)arena->current_region->current - (uintptr_t)arena->current_region->start;
@@ -197,8 +485,9 @@ namespace pb_profiler {
         if (amount > 0) {
             pb_profile_flush_header header;
             header.thread_id = thread_id;
-            header.name_length = strlen(anchor->name);
+            header.name_length = anchor->name != NULL ? strlen(anchor->name) : 0;
             header.result_amount = amount;
+            header.address = anchor->address;
             // printf("writing %lu bytes\n", amount);
             ret = fwrite(&header, sizeof(pb_profile_flush_header), 1, log_file);
             if (ret == 0) {
@@ -206,7 +495,7 @@ namespace pb_profiler {
                 exit(EXIT_FAILURE);
             }
             ret = fwrite(anchor->name, 1, header.name_length, log_file);
-            if (ret == 0) {
+            if (header.name_length > 0 && ret == 0) {
                 printf("Error: fprintf name failed\n");
                 exit(EXIT_FAILURE);
             }
@@ -219,19 +508,212 @@ namespace pb_profiler {
         arena->current_region->current = arena->current_region->start;
         pthread_mutex_unlock(&g_profiler.pb_file_mutex);
     }
-    static inline void pb_profile_anchor_result_add(pb_profile_anchor* anchor, uint64_t thread_id, pb_profile_anchor_result_type type, uint64_t value) {
-        pthread_mutex_lock(&anchor->mutex[thread_id]);
-        Arena* arena = anchor->anchor_results_arena[thread_id];
+
+    // Exemplars are only final when the log is closed, they go in a block after the last flush
+    static inline void pb_profile_exemplars_flush(pb_profile_anchor* anchor, uint64_t thread_id) {
+        pb_profile_anchor_result records[PROFILE_EXEMPLAR_MAX_RECORDS];
+        uint64_t count = pb_profile_exemplar_records(anchor->threads[thread_id], records);
+        if (count == 0) {
+            return;
+        }
+        pb_profile_flush_header header;
+        header.thread_id = thread_id;
+        header.name_length = anchor->name != NULL ? strlen(anchor->name) : 0;
+        header.result_amount = count * sizeof(pb_profile_anchor_result);
+        header.address = anchor->address;
+        pthread_mutex_lock(&g_profiler.pb_file_mutex);
+        if (fwrite(&header, sizeof(pb_profile_flush_header), 1, g_profiler.pb_profile_file) != 1 ||
+            fwrite(anchor->name, 1, header.name_length, g_profiler.pb_profile_file) != header.name_length ||
+            fwrite(records, 1, header.result_amount, g_profiler.pb_profile_file) != header.result_amount) {
+            printf("Error: fwrite exemplars failed\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&g_profiler.pb_file_mutex);
+    }
+    static inline void pb_profile_anchor_result_add_locked(pb_profile_anchor* anchor, uint64_t thread_id, pb_profile_anchor_result_type type, uint64_t value) {
+        Arena* arena = anchor->threads[thread_id].results_arena;
+        if (arena == NULL) {
+            arena = pb_profile_buffer_take();
+            anchor->threads[thread_id].results_arena = arena;
+        }
         pb_profile_anchor_result* result_ptr = (pb_profile_anchor_result*)arena_alloc(arena, sizeof(pb_profile_anchor_result));
         if (result_ptr == NULL) {
-            pb_profile_anchor_thread_flush(anchor, thread_id);
+            if (g_profiler.mode == PB_PROFILER_FLIGHT_RECORDER) {
+                // overwrite the oldest records
+                arena->current_region->current = arena->current_region->start;
+                anchor->threads[thread_id].wrapped = true;
+            } else {
+                pb_profile_anchor_thread_flush(anchor, thread_id);
+            }
             result_ptr = (pb_profile_anchor_result*)arena_alloc(arena, sizeof(pb_profile_anchor_result));
         }
         result_ptr->type = type;
         result_ptr->value = value;
-        pthread_mutex_unlock(&anchor->mutex[thread_id]);
     }
 
+    static inline void pb_profile_anchor_result_add(pb_profile_anchor* anchor, uint64_t thread_id, pb_profile_anchor_result_type type, uint64_t value) {
+        pthread_mutex_lock(&anchor->threads[thread_id].mutex);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, type, value);
+        pthread_mutex_unlock(&anchor->threads[thread_id].mutex);
+    }
+
+    static inline uint64_t pb_profile_thread_id() {
+        uint64_t thread_id = pthread_self();
+        for (uint64_t i = 0; i < sizeof(thread_id); i++) {
+            thread_id = (thread_id << 7) ^ (thread_id >> 3);
+        }
+        return thread_id % PROFILE_MAX_THREADS;
+    }
+
+    // Both records go to the calling thread's buffer under one lock so they stay adjacent
+    static inline void pb_profile_allocation_event(uint64_t site, uint64_t size, uint64_t lifetime, bool freed) {
+        // Frees only carry information when their lifetime was sampled
+        if (!g_profiler.profiling || (freed && lifetime == 0)) {
+            return;
+        }
+        pb_profile_anchor* anchor = &g_profiler.anchors[PROFILE_EVENT_ANCHOR];
+        if (anchor->name == NULL) {
+            anchor->name = "events";
+        }
+        uint64_t thread_id = pb_profile_thread_id();
+        pthread_mutex_lock(&anchor->threads[thread_id].mutex);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_ALLOC_SITE, site);
+        if (freed) {
+            pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_ALLOC_LIFETIME, lifetime);
+        } else {
+            pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_ALLOC_BYTES, size);
+        }
+        pthread_mutex_unlock(&anchor->threads[thread_id].mutex);
+    }
+
+    static inline void pb_profile_function_event(uint64_t function, uint64_t tsc, uint64_t self_tsc) {
+        pb_profile_anchor* anchor = &g_profiler.anchors[PROFILE_EVENT_ANCHOR];
+        if (anchor->name == NULL) {
+            anchor->name = "events";
+        }
+        uint64_t thread_id = pb_profile_thread_id();
+        pthread_mutex_lock(&anchor->threads[thread_id].mutex);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_FUNCTION_SITE, function);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_FUNCTION_TSC, tsc);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_FUNCTION_SELF_TSC, self_tsc);
+        pthread_mutex_unlock(&anchor->threads[thread_id].mutex);
+    }
+
+    // time_function_instrument.cc, include/exclude lists for -finstrument-functions builds
+    void pb_instrument_set_filters(const char* include, const char* exclude);
+
+    static inline void pb_profile_lock_event(uint64_t site, uint64_t wait, uint64_t hold) {
+        if (!g_profiler.profiling) {
+            return;
+        }
+        pb_profile_anchor* anchor = &g_profiler.anchors[PROFILE_EVENT_ANCHOR];
+        if (anchor->name == NULL) {
+            anchor->name = "events";
+        }
+        uint64_t thread_id = pb_profile_thread_id();
+        pthread_mutex_lock(&anchor->threads[thread_id].mutex);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_LOCK_SITE, site);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_LOCK_WAIT, wait);
+        pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_LOCK_HOLD, hold);
+        pthread_mutex_unlock(&anchor->threads[thread_id].mutex);
+    }
+
+    // pthread_mutex_t with the std::mutex interface
+    class pb_pthread_mutex {
+        pthread_mutex_t mutex;
+        public:
+            pb_pthread_mutex() {
+                pthread_mutex_init(&mutex, NULL);
+            }
+            ~pb_pthread_mutex() {
+                pthread_mutex_destroy(&mutex);
+            }
+            inline void lock() {
+                pthread_mutex_lock(&mutex);
+            }
+            inline bool try_lock() {
+                return pthread_mutex_trylock(&mutex) == 0;
+            }
+            inline void unlock() {
+                pthread_mutex_unlock(&mutex);
+            }
+            inline pthread_mutex_t* native_handle() {
+                return &mutex;
+            }
+    };
+
+    // Drop-in mutex (works with std::lock_guard and std::unique_lock) recording per
+    // acquire site, the caller of lock(), the tsc ticks spent waiting and holding.
+    // An acquire counts as contended when the first try_lock fails. When the std
+    // guards aren't inlined (-O0) the caller is the guard's constructor, use
+    // PbProfileLockGuard or lock_at(pb_profile_current_pc()) to keep the sites apart.
+    template <typename Mutex>
+    class PbProfileMutex {
+        Mutex mutex;
+        // Only touched by the holder
+        uint64_t site;
+        uint64_t wait;
+        uint64_t acquired_at;
+        public:
+            __attribute__((noinline)) void lock() {
+                lock_at((uint64_t)__builtin_return_address(0));
+            }
+
+            inline void lock_at(uint64_t site) {
+                uint64_t wait = 0;
+                if (!mutex.try_lock()) {
+                    uint64_t start = __rdtsc();
+                    mutex.lock();
+                    // never 0, that marks an uncontended acquire
+                    wait = __rdtsc() - start + 1;
+                }
+                this->site = site;
+                this->wait = wait;
+                acquired_at = __rdtsc();
+            }
+
+            __attribute__((noinline)) bool try_lock() {
+                if (!mutex.try_lock()) {
+                    return false;
+                }
+                site = (uint64_t)__builtin_return_address(0);
+                wait = 0;
+                acquired_at = __rdtsc();
+                return true;
+            }
+
+            inline void unlock() {
+                uint64_t hold = __rdtsc() - acquired_at;
+                uint64_t site = this->site;
+                uint64_t wait = this->wait;
+                mutex.unlock();
+                // recorded outside the lock so it doesn't add to anyone's wait
+                pb_profile_lock_event(site, wait, hold);
+            }
+
+            inline Mutex& native() {
+                return mutex;
+            }
+    };
+
+    typedef PbProfileMutex<std::mutex> PbStdMutex;
+    typedef PbProfileMutex<pb_pthread_mutex> PbPthreadMutex;
+
+    // Scoped lock whose site is where it's declared, see PbProfileLockGuard
+    template <typename ProfileMutex>
+    class pb_profile_lock_guard {
+        ProfileMutex& mutex;
+        public:
+            pb_profile_lock_guard(ProfileMutex& mutex, uint64_t site) : mutex(mutex) {
+                mutex.lock_at(site);
+            }
+            ~pb_profile_lock_guard() {
+                mutex.unlock();
+            }
+            pb_profile_lock_guard(const pb_profile_lock_guard&) = delete;
+            pb_profile_lock_guard& operator=(const pb_profile_lock_guard&) = delete;
+    };
+
     static inline uint64_t pb_perf_event_read(pb_perf_event_type type) {
         int index = type;
         perf_event_mmap_page* buf = pb_profile_perf_events[index].mmap;
@@ -245,9 +727,13 @@ namespace pb_profiler {
             // rmb();
             index = buf->index;
             offset = buf->offset;
-            if (index == 0) { /* rdpmc not allowed */
-                count = 0;
-                break;
+            if (index == 0) {
+                /* rdpmc not allowed or software event like page faults */
+                uint64_t value = 0;
+                if (read(pb_profile_perf_events[type].fd, &value, sizeof(value)) != sizeof(value)) {
+                    value = 0;
+                }
+                return value;
             }
             count = _rdpmc(index - 1);
             // rmb();
@@ -257,7 +743,8 @@ namespace pb_profiler {
         return count;
     }
 
-    inline void pb_perf_event_open(pb_perf_event_type type) {
+    // Returns false instead of exiting when the counter can't be opened
+    inline bool pb_perf_event_try_open(pb_perf_event_type type) {
         int index = type;
         if (pb_profile_perf_events[index].initailized == 0) {
             perf_event_attr attr;
@@ -294,35 +781,47 @@ namespace pb_profiler {
                     break;
                 default:
                     printf("Error: unknown perf event type %d\n", type);
-                    exit(EXIT_FAILURE);
+                    return false;
             }
             pb_profile_perf_events[index].fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
             if (pb_profile_perf_events[index].fd == -1) {
-                printf("Error: perf_event_open failed for type %d\n", type);
-                exit(EXIT_FAILURE);
+                return false;
             }
             pb_profile_perf_events[index].mmap = (perf_event_mmap_page*)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, pb_profile_perf_events[index].fd, 0);
             if (pb_profile_perf_events[index].mmap == MAP_FAILED) {
-                printf("Error: mmap failed for type %d\n", type);
-                exit(EXIT_FAILURE);
+                close(pb_profile_perf_events[index].fd);
+                return false;
             }
             ioctl(pb_profile_perf_events[index].fd, PERF_EVENT_IOC_RESET, 0);
             ioctl(pb_profile_perf_events[index].fd, PERF_EVENT_IOC_ENABLE);
             pb_profile_perf_events[index].initailized = 1;
         }
+        return true;
+    }
+
+    inline void pb_perf_event_open(pb_perf_event_type type) {
+        if (pb_profile_perf_events[type].initailized == 0 && !pb_perf_event_try_open(type)) {
+            printf("Error: perf_event_open failed for type %d\n", type);
+            exit(EXIT_FAILURE);
+        }
     } 
 
-    enum PbProfileFlags {
-        PB_PROFILE_CACHE = 1,
-        PB_PROFILE_PAGE_FAULTS = 2,
-        PB_PROFILE_INSTRUCTIONS = 4,
-        PB_PROFILE_CYCLES = 8,
-        PB_PROFILE_BRANCH = 16,
-    };
+
+    // Address of the call to this function. Out of line so the call instruction
+    // sits in the caller's code at the caller's line, an inlined lea ends up
+    // inside the PbProfile constructor's code and line info. The return address
+    // - 1 is inside the call, the return address itself can be on the next line.
+    // The empty volatile asm keeps the compiler from treating it as const and
+    // merging the calls of sites inlined into one function.
+    __attribute__((noinline)) static uint64_t pb_profile_current_pc() {
+        __asm__ volatile("");
+        return (uint64_t)__builtin_return_address(0) - 1;
+    }
 
     class PbProfile {
         public:
-            uint64_t start_cycles, start_cache, start_branch;
+            uint64_t start_cycles, start_cache, start_branch, start_page_faults, start_tsc;
+            uint64_t bytes, items;
             const char* function;
             uint64_t index;
             uint32_t processor_id;
@@ -331,10 +830,31 @@ namespace pb_profiler {
                 if (!g_profiler.profiling) {
                     return;
                 }
-                g_profiler.anchors[index].name = function;
+                // Avoid dirtying the anchor line shared by every thread on each call
+                if (g_profiler.anchors[index].name != function) {
+                    g_profiler.anchors[index].name = function;
+                }
                 this->function = function;
+                start(index, flags);
+            }
+
+            // Keyed by a code address, stats resolves it to function and file:line
+            PbProfile(const void* address, uint64_t index, uint64_t flags = 0) {
+                if (!g_profiler.profiling) {
+                    return;
+                }
+                if (g_profiler.anchors[index].address != (uint64_t)address) {
+                    g_profiler.anchors[index].address = (uint64_t)address;
+                }
+                this->function = NULL;
+                start(index, flags);
+            }
+
+            inline void start(uint64_t index, uint64_t flags) {
                 this->index = index;
                 this->flags = flags;
+                bytes = 0;
+                items = 0;
                 // start = __rdtscp(&processor_id);
 
 
@@ -355,41 +875,105 @@ namespace pb_profiler {
                     start_branch = prev;
                 }
 
+                if (flags & PB_PROFILE_PAGE_FAULTS) {
+                    pb_perf_event_open(PB_PERF_PAGE_FAULTS);
+                    uint64_t prev = pb_perf_event_read(PB_PERF_PAGE_FAULTS);
+                    start_page_faults = prev;
+                }
+                // last so the counter reads above aren't part of the scope's time
+                start_tsc = __rdtsc();
+            }
+
+            // Payload of the scope, stats reports cycles per byte, GB/s and items/s from it
+            inline void add_bytes(uint64_t count) {
+                bytes += count;
+            }
+
+            inline void add_items(uint64_t count) {
+                items += count;
             }
 
             inline uint64_t hash_thread_id() {
-                uint64_t thread_id = pthread_self();
-                for (uint64_t i = 0; i < sizeof(thread_id); i++) {
-                    thread_id = (thread_id << 7) ^ (thread_id >> 3);
-                }
-                return thread_id % PROFILE_MAX_THREADS;
+                return pb_profile_thread_id();
             }
 
 
-            ~PbProfile() {
+            // Out of line so frame 0 of an exemplar stack is always this destructor and can be dropped
+            __attribute__((noinline)) ~PbProfile() {
                 if (!g_profiler.profiling) {
                     return;
                 }
                 // uint64_t elapsed = __rdtscp(&end_processor_id) - start;
                 uint64_t thread_id = hash_thread_id();
-
-                {
-                    uint64_t count = pb_perf_event_read(PB_PERF_CYCLES);
-                    count -= start_cycles;
-                    pb_profile_anchor_result_add(&g_profiler.anchors[index], thread_id, PB_PROFILE_ANCHOR_CYCLES, count);
+                // Counters are read before taking the lock so it isn't measured
+                uint64_t cycles = pb_perf_event_read(PB_PERF_CYCLES) - start_cycles;
+                uint64_t cache = 0, branch = 0, page_faults = 0;
+                if (flags & PB_PROFILE_CACHE) {
+                    // TODO(pere): deal with overflow
+                    cache = pb_perf_event_read(PB_PERF_CACHE_MISSES) - start_cache;
+                }
+                if (flags & PB_PROFILE_BRANCH) {
+                    branch = pb_perf_event_read(PB_PERF_BRANCH_MISS) - start_branch;
+                }
+                if (flags & PB_PROFILE_PAGE_FAULTS) {
+                    page_faults = pb_perf_event_read(PB_PERF_PAGE_FAULTS) - start_page_faults;
+                }
+                uint64_t timestamp;
+                unsigned int tsc_aux = 0;
+                if (flags & PB_PROFILE_CPU) {
+                    // Linux keeps (node << 12) | cpu in TSC_AUX
+                    timestamp = __rdtscp(&tsc_aux);
+                } else {
+                    timestamp = __rdtsc();
+                }
+                uint64_t tsc = timestamp - start_tsc;
+                pb_profile_anchor* anchor = &g_profiler.anchors[index];
+                pb_profile_exemplar exemplar;
+                exemplar.frame_count = 0;
+                if ((flags & PB_PROFILE_STACK) && pb_profile_exemplar_wanted(anchor->threads[thread_id], cycles)) {
+                    void* frames[PROFILE_EXEMPLAR_FRAMES + 1];
+                    int count = backtrace(frames, PROFILE_EXEMPLAR_FRAMES + 1);
+                    exemplar.frame_count = count > 1 ? count - 1 : 0;
+                    memcpy(exemplar.frames, frames + 1, sizeof(void*) * exemplar.frame_count);
                 }
 
+                // One lock per scope, its records stay adjacent behind the timestamp
+                pthread_mutex_lock(&anchor->threads[thread_id].mutex);
+                pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_TIMESTAMP, timestamp);
+                if (flags & PB_PROFILE_CPU) {
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_CPU, tsc_aux & 0xfff);
+                }
+                pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_CYCLES, cycles);
+                pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_TSC, tsc);
                 if (flags & PB_PROFILE_CACHE) {
-                    // TODO(pere): deal with overflow
-                    uint64_t count = pb_perf_event_read(PB_PERF_CACHE_MISSES);
-                    count -= start_cache;
-                    pb_profile_anchor_result_add(&g_profiler.anchors[index], thread_id, PB_PROFILE_ANCHOR_CACHE_MISSES, count);
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_CACHE_MISSES, cache);
                 }
                 if (flags & PB_PROFILE_BRANCH) {
-                    uint64_t count = pb_perf_event_read(PB_PERF_BRANCH_MISS);
-                    count -= start_branch;
-                    pb_profile_anchor_result_add(&g_profiler.anchors[index], thread_id, PB_PROFILE_ANCHOR_BRANCH_MISSES, count);
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_BRANCH_MISSES, branch);
+                }
+                if (flags & PB_PROFILE_PAGE_FAULTS) {
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_PAGE_FAULTS, page_faults);
+                }
+                if (bytes > 0) {
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_BYTES, bytes);
+                }
+                if (items > 0) {
+                    pb_profile_anchor_result_add_locked(anchor, thread_id, PB_PROFILE_ANCHOR_ITEMS, items);
                 }
+                if (pb_profile_exemplar_wanted(anchor->threads[thread_id], cycles)) {
+                    exemplar.timestamp = timestamp;
+                    exemplar.flags = flags;
+                    exemplar.cpu = tsc_aux & 0xfff;
+                    exemplar.cycles = cycles;
+                    exemplar.tsc = tsc;
+                    exemplar.cache_misses = cache;
+                    exemplar.branch_misses = branch;
+                    exemplar.page_faults = page_faults;
+                    exemplar.bytes = bytes;
+                    exemplar.items = items;
+                    pb_profile_exemplar_offer_locked(anchor->threads[thread_id], exemplar);
+                }
+                pthread_mutex_unlock(&anchor->threads[thread_id].mutex);
 
                 // if (processor_id != end_processor_id) {
                 //   pb_profile_anchor_result_add(&g_profiler.anchors[index], thread_id, PB_PROFILE_ANCHOR_CPU_MIGRATIONS, elapsed);
@@ -446,27 +1030,291 @@ namespace pb_profiler {
 //         }
 //     }
 
+    static void pb_flight_recorder_dump_requested();
+
     static void* profile_thread_entry(void* ctx) {
+        uint64_t ticks = 0;
         while (g_profiler.profiling) {
-            sleep(1);
-            printf("profiling\n");
-            // print_profiling();
+            if (g_profiler.mode == PB_PROFILER_FLIGHT_RECORDER) {
+                timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += PROFILE_BUFFER_POOL_REFILL_MS * 1000 * 1000;
+                if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+                    deadline.tv_sec += 1;
+                    deadline.tv_nsec -= 1000 * 1000 * 1000;
+                }
+                if (sem_timedwait(&g_profiler.dump_request, &deadline) == 0 && g_profiler.profiling) {
+                    pb_flight_recorder_dump_requested();
+                }
+            } else {
+                timespec sleep_time = {0, PROFILE_BUFFER_POOL_REFILL_MS * 1000 * 1000};
+                nanosleep(&sleep_time, NULL);
+                if (++ticks % (1000 / PROFILE_BUFFER_POOL_REFILL_MS) == 0) {
+                    printf("profiling\n");
+                }
+                // print_profiling();
+            }
+            pb_profile_buffer_pool_refill();
         }
         return NULL;
     }
 
+    static inline uint64_t pb_profile_monotonic_ns() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
 
+    // tsc ticks per second measured against CLOCK_MONOTONIC over 10ms
+    static inline uint64_t pb_profile_tsc_hz() {
+        uint64_t start_ns = pb_profile_monotonic_ns();
+        uint64_t start_tsc = __rdtsc();
+        timespec sleep_time = {0, 10 * 1000 * 1000};
+        nanosleep(&sleep_time, NULL);
+        uint64_t elapsed_tsc = __rdtsc() - start_tsc;
+        uint64_t elapsed_ns = pb_profile_monotonic_ns() - start_ns;
+        return (uint64_t)((double)elapsed_tsc * 1e9 / (double)elapsed_ns);
+    }
 
+    // The kernel's tsc to ns parameters from the cycles counter page, the same on
+    // every thread. cap_user_time stays 0 when perf or a stable tsc is missing.
+    static inline void pb_perf_time_params() {
+        if (!pb_perf_event_try_open(PB_PERF_CYCLES)) {
+            return;
+        }
+        perf_event_mmap_page* page = pb_profile_perf_events[PB_PERF_CYCLES].mmap;
+        uint32_t seq;
+        do {
+            seq = page->lock;
+            __asm__ volatile("" ::: "memory");
+            g_profiler.cap_user_time = page->cap_user_time;
+            g_profiler.time_zero = page->time_zero;
+            g_profiler.time_mult = page->time_mult;
+            g_profiler.time_shift = page->time_shift;
+            __asm__ volatile("" ::: "memory");
+        } while (page->lock != seq);
+    }
 
-    static void pb_init_log_file(const char* filename) {
+    // Log header followed by /proc/self/maps in one malloc'd buffer, shared
+    // libraries loaded after it is built can't be symbolized
+    static char* pb_build_log_header(uint64_t* length) {
+        char* buffer = (char*)malloc(sizeof(pb_profile_log_header) + 64 * 1024);
+        size_t capacity = 64 * 1024;
+        size_t maps_length = 0;
+        FILE* maps_file = fopen("/proc/self/maps", "r");
+        if (maps_file != NULL) {
+            // procfs files report size 0, read them to the end
+            size_t ret;
+            while ((ret = fread(buffer + sizeof(pb_profile_log_header) + maps_length, 1, capacity - maps_length, maps_file)) > 0) {
+                maps_length += ret;
+                if (maps_length == capacity) {
+                    capacity *= 2;
+                    buffer = (char*)realloc(buffer, sizeof(pb_profile_log_header) + capacity);
+                }
+            }
+            fclose(maps_file);
+        }
+        pb_profile_log_header header;
+        header.magic = PROFILE_LOG_MAGIC;
+        header.version = PROFILE_LOG_VERSION;
+        header.pid = getpid();
+        header.tsc_start = g_profiler.tsc_start;
+        header.tsc_hz = g_profiler.tsc_hz;
+        header.time_zero = g_profiler.time_zero;
+        header.time_mult = g_profiler.time_mult;
+        header.time_shift = g_profiler.time_shift;
+        header.cap_user_time = g_profiler.cap_user_time;
+        header.maps_length = maps_length;
+        memcpy(buffer, &header, sizeof(pb_profile_log_header));
+        *length = sizeof(pb_profile_log_header) + maps_length;
+        return buffer;
+    }
+
+    static void pb_write_log_header(FILE* log_file) {
+        uint64_t length;
+        char* header = pb_build_log_header(&length);
+        if (fwrite(header, 1, length, log_file) != length) {
+            printf("Error: fwrite log header failed\n");
+            exit(EXIT_FAILURE);
+        }
+        free(header);
+    }
+
+    // Only async-signal-safe calls from here to pb_flight_recorder_dump_fd, fatal signals dump through them
+    static inline bool pb_write_all(int fd, const void* data, size_t length) {
+        const char* pos = (const char*)data;
+        while (length > 0) {
+            ssize_t ret = write(fd, pos, length);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            pos += ret;
+            length -= ret;
+        }
+        return true;
+    }
+
+    // "<pid>-<log name>.<n>.dump"
+    static inline int pb_flight_recorder_open_dump() {
+        char path[sizeof(g_profiler.dump_prefix) + 32];
+        size_t length = strlen(g_profiler.dump_prefix);
+        memcpy(path, g_profiler.dump_prefix, length);
+        path[length++] = '.';
+        uint64_t number = __atomic_fetch_add(&g_profiler.dump_count, 1, __ATOMIC_RELAXED);
+        char digits[24];
+        int digit_count = 0;
+        do {
+            digits[digit_count++] = '0' + number % 10;
+            number /= 10;
+        } while (number > 0);
+        while (digit_count > 0) {
+            path[length++] = digits[--digit_count];
+        }
+        memcpy(path + length, ".dump", sizeof(".dump"));
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    // Oldest records first. After a wrap the oldest side can start in the middle
+    // of a scope, it is skipped up to the next timestamp or event site.
+    static inline void pb_flight_recorder_write_thread(int fd, pb_profile_anchor* anchor, uint64_t thread_id) {
+        pb_profile_anchor_thread& anchor_thread = anchor->threads[thread_id];
+        Arena* arena = anchor_thread.results_arena;
+        if (arena == NULL) {
+            return;
+        }
+        char* start = (char*)arena->current_region->start;
+        char* current = (char*)arena->current_region->current;
+        char* old_start = current;
+        char* old_end = anchor_thread.wrapped ? (char*)arena->current_region->end : current;
+        old_end = start + (old_end - start) / sizeof(pb_profile_anchor_result) * sizeof(pb_profile_anchor_result);
+        while (old_start < old_end &&
+               ((pb_profile_anchor_result*)old_start)->type != PB_PROFILE_ANCHOR_TIMESTAMP &&
+               ((pb_profile_anchor_result*)old_start)->type != PB_PROFILE_ANCHOR_ALLOC_SITE &&
+               ((pb_profile_anchor_result*)old_start)->type != PB_PROFILE_ANCHOR_LOCK_SITE &&
+               ((pb_profile_anchor_result*)old_start)->type != PB_PROFILE_ANCHOR_FUNCTION_SITE) {
+            old_start += sizeof(pb_profile_anchor_result);
+        }
+        pb_profile_flush_header header;
+        header.thread_id = thread_id;
+        header.name_length = anchor->name != NULL ? strlen(anchor->name) : 0;
+        header.result_amount = (old_end - old_start) + (current - start);
+        header.address = anchor->address;
+        if (header.result_amount > 0) {
+            pb_write_all(fd, &header, sizeof(header));
+            pb_write_all(fd, anchor->name, header.name_length);
+            pb_write_all(fd, old_start, old_end - old_start);
+            pb_write_all(fd, start, current - start);
+        }
+        pb_profile_anchor_result records[PROFILE_EXEMPLAR_MAX_RECORDS];
+        header.result_amount = pb_profile_exemplar_records(anchor_thread, records) * sizeof(pb_profile_anchor_result);
+        if (header.result_amount > 0) {
+            pb_write_all(fd, &header, sizeof(header));
+            pb_write_all(fd, anchor->name, header.name_length);
+            pb_write_all(fd, records, header.result_amount);
+        }
+    }
+
+    // Without locks when called from a fatal signal, the crashed thread may hold one
+    static inline void pb_flight_recorder_dump_fd(int fd, const char* log_header, uint64_t log_header_length, bool lock) {
+        pb_write_all(fd, log_header, log_header_length);
+        for (uint64_t i = 0; i < PROFILE_MAX_ANCHORS; i++) {
+            for (uint64_t j = 0; j < PROFILE_MAX_THREADS; j++) {
+                pb_profile_anchor_thread& anchor_thread = g_profiler.anchors[i].threads[j];
+                if (lock) {
+                    pthread_mutex_lock(&anchor_thread.mutex);
+                }
+                pb_flight_recorder_write_thread(fd, &g_profiler.anchors[i], j);
+                if (lock) {
+                    pthread_mutex_unlock(&anchor_thread.mutex);
+                }
+            }
+        }
+    }
+
+    static const int pb_flight_recorder_signals[PROFILE_FATAL_SIGNAL_COUNT + 1] = {
+        SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGUSR2,
+    };
+
+    static void pb_flight_recorder_signal(int signal) {
+        int saved_errno = errno;
+        if (signal == SIGUSR2) {
+            sem_post(&g_profiler.dump_request);
+            errno = saved_errno;
+            return;
+        }
+        int fd = pb_flight_recorder_open_dump();
+        if (fd >= 0) {
+            pb_flight_recorder_dump_fd(fd, g_profiler.log_header, g_profiler.log_header_length, false);
+            close(fd);
+        }
+        // let the previous handler or the default action finish the process
+        for (int i = 0; i < PROFILE_FATAL_SIGNAL_COUNT; i++) {
+            if (pb_flight_recorder_signals[i] == signal) {
+                sigaction(signal, &g_profiler.old_actions[i], NULL);
+            }
+        }
+        raise(signal);
+        errno = saved_errno;
+    }
+
+    // Writes the rings of every thread to a new "<pid>-<log name>.<n>.dump" log, returns false if it can't be created
+    static bool pb_flight_recorder_dump() {
+        if (!g_profiler.profiling || g_profiler.mode != PB_PROFILER_FLIGHT_RECORDER) {
+            return false;
+        }
+        int fd = pb_flight_recorder_open_dump();
+        if (fd < 0) {
+            return false;
+        }
+        // maps read now include libraries loaded since start
+        uint64_t length;
+        char* header = pb_build_log_header(&length);
+        pb_flight_recorder_dump_fd(fd, header, length, true);
+        free(header);
+        close(fd);
+        return true;
+    }
+
+    static void pb_flight_recorder_dump_requested() {
+        if (!pb_flight_recorder_dump()) {
+            printf("Error: flight recorder dump failed %s\n", strerror(errno));
+        }
+    }
+
+    static void pb_init_log_file(const char* filename, pb_profiler_mode mode, uint64_t ring_size) {
         // g_profiler.start = __rdtsc();
+        g_profiler.mode = mode;
+        g_profiler.ring_size = ring_size;
+        g_profiler.tsc_hz = pb_profile_tsc_hz();
+        pb_perf_time_params();
+        g_profiler.tsc_start = __rdtsc();
         g_profiler.profiling = true;
         g_profiler.pb_profile_file = NULL;
-        g_profiler.pb_profile_file = fopen(filename, "w");
-        if (g_profiler.pb_profile_file == NULL) {
-            printf("Error: fopen() failed log file %s\n", filename);
-            exit(EXIT_FAILURE);
+        if (mode == PB_PROFILER_FLIGHT_RECORDER) {
+            PROFILE_ASSERT(ring_size % sizeof(pb_profile_anchor_result) == 0 && ring_size > 0);
+            snprintf(g_profiler.dump_prefix, sizeof(g_profiler.dump_prefix), "%s", filename);
+            g_profiler.log_header = pb_build_log_header(&g_profiler.log_header_length);
+            sem_init(&g_profiler.dump_request, 0, 0);
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = pb_flight_recorder_signal;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART;
+            for (int i = 0; i < PROFILE_FATAL_SIGNAL_COUNT + 1; i++) {
+                sigaction(pb_flight_recorder_signals[i], &action, &g_profiler.old_actions[i]);
+            }
+        } else {
+            g_profiler.pb_profile_file = fopen(filename, "w");
+            if (g_profiler.pb_profile_file == NULL) {
+                printf("Error: fopen() failed log file %s\n", filename);
+                exit(EXIT_FAILURE);
+            }
+            pb_write_log_header(g_profiler.pb_profile_file);
         }
+        pb_profile_buffer_pool_refill();
         int ret = pthread_create(&g_profiler.pb_profile_thread, NULL, profile_thread_entry, NULL);
         if (ret != 0) {
             printf("Error: pthread_create() failed %s\n", strerror(ret));
@@ -478,27 +1326,56 @@ namespace pb_profiler {
     static void pb_close_log_file() {
         pb_profiler_t &profiler = g_profiler;
         g_profiler.profiling = false;
+        if (g_profiler.mode == PB_PROFILER_FLIGHT_RECORDER) {
+            sem_post(&g_profiler.dump_request);
+        }
         pthread_join(g_profiler.pb_profile_thread, NULL);
+        if (g_profiler.mode == PB_PROFILER_FLIGHT_RECORDER) {
+            for (int i = 0; i < PROFILE_FATAL_SIGNAL_COUNT + 1; i++) {
+                sigaction(pb_flight_recorder_signals[i], &g_profiler.old_actions[i], NULL);
+            }
+            sem_destroy(&g_profiler.dump_request);
+        }
         // print_profiling();
         for ( uint64_t i = 0; i < PROFILE_MAX_ANCHORS; i++) {
             for (uint64_t j = 0; j < PROFILE_MAX_THREADS; j++) {
-                pthread_mutex_lock(&profiler.anchors[i].mutex[j]);
-                pb_profile_anchor_thread_flush(&profiler.anchors[i], j);
-                pthread_mutex_unlock(&profiler.anchors[i].mutex[j]);
+                pb_profile_anchor_thread& anchor_thread = profiler.anchors[i].threads[j];
+                if (g_profiler.mode == PB_PROFILER_FLUSH) {
+                    pthread_mutex_lock(&anchor_thread.mutex);
+                    pb_profile_anchor_thread_flush(&profiler.anchors[i], j);
+                    pb_profile_exemplars_flush(&profiler.anchors[i], j);
+                    pthread_mutex_unlock(&anchor_thread.mutex);
+                }
 
-                pthread_mutex_destroy(&profiler.anchors[i].mutex[j]);
-                arena_destroy(profiler.anchors[i].anchor_results_arena[j]);
+                pthread_mutex_destroy(&anchor_thread.mutex);
+                if (anchor_thread.results_arena != NULL) {
+                    arena_destroy(anchor_thread.results_arena);
+                }
+                free(anchor_thread.exemplars);
+                anchor_thread.exemplars = NULL;
             }
         }
-        fclose(g_profiler.pb_profile_file);
-        g_profiler.pb_profile_file = NULL;
+        for (uint64_t i = 0; i < PROFILE_BUFFER_POOL_SIZE; i++) {
+            if (g_profiler.buffer_pool[i] != NULL) {
+                arena_destroy(g_profiler.buffer_pool[i]);
+                g_profiler.buffer_pool[i] = NULL;
+            }
+        }
+        if (g_profiler.pb_profile_file != NULL) {
+            fclose(g_profiler.pb_profile_file);
+            g_profiler.pb_profile_file = NULL;
+        }
+        free(g_profiler.log_header);
+        g_profiler.log_header = NULL;
     }
 
 
     class PbProfilerStart {
         Arena* profiler_arena;
         public:
-        PbProfilerStart(const char* filename) {
+        // Flight recorder mode keeps the last ring_size bytes of records per anchor and thread in
+        // memory, they are written by pb_flight_recorder_dump(), SIGUSR2 or a fatal signal
+        PbProfilerStart(const char* filename, pb_profiler_mode mode = PB_PROFILER_FLUSH, uint64_t ring_size = PROFILE_FLIGHT_RING_SIZE) {
             pb_profiler_t& profiler = g_profiler;
             char buffer[1024];
             profiler_arena = arena_create(sizeof(pb_profile_anchor) * PROFILE_MAX_ANCHORS, true);
@@ -516,11 +1393,11 @@ namespace pb_profiler {
             memset(profiler.anchors, 0, sizeof(pb_profile_anchor) * PROFILE_MAX_ANCHORS);
             for (uint64_t i = 0; i < PROFILE_MAX_ANCHORS; i++) {
                 for (uint64_t j = 0; j < PROFILE_MAX_THREADS; j++) {
-                    pthread_mutex_init(&profiler.anchors[i].mutex[j], NULL);
-                    profiler.anchors[i].anchor_results_arena[j] = arena_create(1024 * 1024*20, false);
+                    pthread_mutex_init(&profiler.anchors[i].threads[j].mutex, NULL);
+                    profiler.anchors[i].threads[j].results_arena = NULL;
                 }
             }
-            pb_init_log_file(buffer); 
+            pb_init_log_file(buffer, mode, ring_size);
         }
         ~PbProfilerStart() {
           if (g_profiler.profiling) {
@@ -535,6 +1412,25 @@ namespace pb_profiler {
 #define NameConcat(A, B) NameConcat2(A, B)
 #define PbProfileFunction(variable, label) pb_profiler::PbProfile variable((const char*)label, (uint64_t)(__COUNTER__ + 1))
 #define PbProfileFunctionF(variable, label, flags) pb_profiler::PbProfile variable((const char*)label, (uint64_t)(__COUNTER__ + 1), flags)
+// Anchors keyed by the address of the scope itself or by an explicit code address, no string is kept or written
+#define PbProfileHere(variable) pb_profiler::PbProfile variable((const void*)pb_profiler::pb_profile_current_pc(), (uint64_t)(__COUNTER__ + 1))
+#define PbProfileHereF(variable, flags) pb_profiler::PbProfile variable((const void*)pb_profiler::pb_profile_current_pc(), (uint64_t)(__COUNTER__ + 1), flags)
+#define PbProfileAddress(variable, address) pb_profiler::PbProfile variable((const void*)(address), (uint64_t)(__COUNTER__ + 1))
+#define PbProfileAddressF(variable, address, flags) pb_profiler::PbProfile variable((const void*)(address), (uint64_t)(__COUNTER__ + 1), flags)
+// std::lock_guard over a PbStdMutex/PbPthreadMutex with the site taken here, not in the guard's constructor
+#define PbProfileLockGuard(variable, mutex) pb_profiler::pb_profile_lock_guard<typename std::remove_reference<decltype(mutex)>::type> variable((mutex), pb_profiler::pb_profile_current_pc())
+
+#ifdef PB_H
+// Include pb.h first to get the glue between tracking allocators and the profiler
+static inline void pb_profile_tracking_hook(void* ctx, u64 site, u64 size, u64 lifetime, int freed) {
+    pb_profiler::pb_profile_allocation_event(site, size, lifetime, freed != 0);
+}
+
+// Allocation events of a tracking allocator land in the "events" anchor
+static inline void pb_profile_track_allocator(Allocator* tracking) {
+    pb_tracking_set_hook(tracking, pb_profile_tracking_hook, NULL);
+}
+#endif
 
 #define PROFILE_MANUAL
 #ifndef PROFILE_MANUAL
@@ -61,7 +61,7 @@ void infinite() {
 
 void third() {
   for (int i = 0; i < 1000; i++) {
-    PbProfileFunctionF(f, "third", 0);
+    PbProfileFunctionF(f, "third", PB_PROFILE_CPU);
     for (int j = 0; j < 1000; j++) {
       // 1 cache miss
       blobs[j][i].a[0] = rand() % 1000;
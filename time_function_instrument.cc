@@ -0,0 +1,215 @@
+// Whole program profiling with -finstrument-functions. Build this file without
+// the flag and link it, with profiler.cc, into a program compiled with
+//   -finstrument-functions [-finstrument-functions-exclude-file-list=...]
+// then start the profiler as usual. Every instrumented call writes its function
+// address, inclusive and self (minus instrumented children) tsc ticks into the
+// calling thread's buffer of the events anchor, stats symbolizes the addresses.
+//
+// PB_INSTRUMENT_INCLUDE and PB_INSTRUMENT_EXCLUDE, or pb_instrument_set_filters()
+// before the profiler starts, take comma separated substrings matched against
+// the symbol name (executables need -rdynamic for it) and the path of the object
+// holding the function. With an include list only matching functions are
+// recorded, excludes win over includes. Each function is decided once, later
+// calls hit a per thread cache.
+#include <dlfcn.h>
+#include "time_function.h"
+
+// Frames deeper than this are not timed, calls keep being counted to stay balanced
+#define PB_INSTRUMENT_MAX_DEPTH 256
+// Shared function -> decision table, power of two
+#define PB_INSTRUMENT_FILTER_SLOTS 65536
+// Per thread direct mapped cache in front of it, power of two
+#define PB_INSTRUMENT_CACHE_SLOTS 256
+#define PB_INSTRUMENT_FILTER_SIZE 4096
+
+namespace pb_profiler {
+    enum pb_instrument_decision {
+        PB_INSTRUMENT_UNKNOWN = 0,
+        PB_INSTRUMENT_INCLUDED = 1,
+        PB_INSTRUMENT_EXCLUDED = 2,
+    };
+
+    struct pb_instrument_filter_slot {
+        uint64_t function;
+        uint64_t decision;
+    };
+
+    struct pb_instrument_frame {
+        uint64_t function;
+        // hook frame address, callees always sit below their live callers
+        uint64_t stack_address;
+        uint64_t start;
+        // inclusive ticks of instrumented callees, subtracted for the self time
+        uint64_t children;
+    };
+
+    struct pb_instrument_thread {
+        uint64_t cache_functions[PB_INSTRUMENT_CACHE_SLOTS];
+        uint8_t cache_decisions[PB_INSTRUMENT_CACHE_SLOTS];
+        pb_instrument_frame stack[PB_INSTRUMENT_MAX_DEPTH];
+        uint64_t depth;
+        bool in_hook;
+    };
+
+    // Plain zero initialized storage only, hooks can run before any constructor
+    static __thread pb_instrument_thread pb_instrument_state;
+    static pb_instrument_filter_slot pb_instrument_filters[PB_INSTRUMENT_FILTER_SLOTS];
+    static char pb_instrument_include[PB_INSTRUMENT_FILTER_SIZE];
+    static char pb_instrument_exclude[PB_INSTRUMENT_FILTER_SIZE];
+    static pthread_once_t pb_instrument_once = PTHREAD_ONCE_INIT;
+
+    __attribute__((no_instrument_function)) static void pb_instrument_read_env() {
+        const char* include = getenv("PB_INSTRUMENT_INCLUDE");
+        const char* exclude = getenv("PB_INSTRUMENT_EXCLUDE");
+        if (include != NULL && pb_instrument_include[0] == '\0') {
+            snprintf(pb_instrument_include, sizeof(pb_instrument_include), "%s", include);
+        }
+        if (exclude != NULL && pb_instrument_exclude[0] == '\0') {
+            snprintf(pb_instrument_exclude, sizeof(pb_instrument_exclude), "%s", exclude);
+        }
+    }
+
+    // Any comma separated pattern of the list found in the symbol or the object path
+    __attribute__((no_instrument_function)) static bool pb_instrument_matches(const char* list, const char* symbol, const char* object) {
+        const char* pattern = list;
+        while (*pattern != '\0') {
+            const char* end = strchr(pattern, ',');
+            size_t length = end != NULL ? (size_t)(end - pattern) : strlen(pattern);
+            if (length > 0) {
+                char buffer[PB_INSTRUMENT_FILTER_SIZE];
+                memcpy(buffer, pattern, length);
+                buffer[length] = '\0';
+                if ((symbol != NULL && strstr(symbol, buffer) != NULL) || (object != NULL && strstr(object, buffer) != NULL)) {
+                    return true;
+                }
+            }
+            if (end == NULL) {
+                break;
+            }
+            pattern = end + 1;
+        }
+        return false;
+    }
+
+    __attribute__((no_instrument_function)) static uint8_t pb_instrument_decide(uint64_t function) {
+        pthread_once(&pb_instrument_once, pb_instrument_read_env);
+        if (pb_instrument_include[0] == '\0' && pb_instrument_exclude[0] == '\0') {
+            return PB_INSTRUMENT_INCLUDED;
+        }
+        Dl_info info;
+        memset(&info, 0, sizeof(info));
+        dladdr((void*)function, &info);
+        if (pb_instrument_matches(pb_instrument_exclude, info.dli_sname, info.dli_fname)) {
+            return PB_INSTRUMENT_EXCLUDED;
+        }
+        if (pb_instrument_include[0] != '\0' && !pb_instrument_matches(pb_instrument_include, info.dli_sname, info.dli_fname)) {
+            return PB_INSTRUMENT_EXCLUDED;
+        }
+        return PB_INSTRUMENT_INCLUDED;
+    }
+
+    // Open addressing, a slot is claimed by a CAS on the function and its decision published after.
+    // A full table still decides, it just doesn't remember.
+    __attribute__((no_instrument_function)) static uint8_t pb_instrument_lookup(uint64_t function) {
+        uint64_t mask = PB_INSTRUMENT_FILTER_SLOTS - 1;
+        uint64_t index = (function >> 4) * 0x9e3779b97f4a7c15ULL >> 48 & mask;
+        for (uint64_t probe = 0; probe < PB_INSTRUMENT_FILTER_SLOTS; probe++) {
+            pb_instrument_filter_slot& slot = pb_instrument_filters[(index + probe) & mask];
+            uint64_t current = __atomic_load_n(&slot.function, __ATOMIC_ACQUIRE);
+            if (current == 0) {
+                uint64_t expected = 0;
+                if (!__atomic_compare_exchange_n(&slot.function, &expected, function, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    current = expected;
+                } else {
+                    uint8_t decision = pb_instrument_decide(function);
+                    __atomic_store_n(&slot.decision, decision, __ATOMIC_RELEASE);
+                    return decision;
+                }
+            }
+            if (current == function) {
+                uint64_t decision = __atomic_load_n(&slot.decision, __ATOMIC_ACQUIRE);
+                // claimed by a thread still deciding
+                return decision != PB_INSTRUMENT_UNKNOWN ? decision : pb_instrument_decide(function);
+            }
+        }
+        return pb_instrument_decide(function);
+    }
+
+    __attribute__((no_instrument_function)) static inline bool pb_instrument_included(pb_instrument_thread& state, uint64_t function) {
+        uint64_t index = (function >> 4) & (PB_INSTRUMENT_CACHE_SLOTS - 1);
+        if (state.cache_functions[index] == function) {
+            return state.cache_decisions[index] == PB_INSTRUMENT_INCLUDED;
+        }
+        state.in_hook = true;
+        uint8_t decision = pb_instrument_lookup(function);
+        state.in_hook = false;
+        state.cache_functions[index] = function;
+        state.cache_decisions[index] = decision;
+        return decision == PB_INSTRUMENT_INCLUDED;
+    }
+
+    // Replaces the environment, call it before the profiler starts
+    __attribute__((no_instrument_function)) void pb_instrument_set_filters(const char* include, const char* exclude) {
+        snprintf(pb_instrument_include, sizeof(pb_instrument_include), "%s", include != NULL ? include : "");
+        snprintf(pb_instrument_exclude, sizeof(pb_instrument_exclude), "%s", exclude != NULL ? exclude : "");
+        // an empty string keeps the environment out
+        if (pb_instrument_include[0] == '\0' && pb_instrument_exclude[0] == '\0') {
+            pthread_once(&pb_instrument_once, [] {});
+        }
+    }
+}
+
+using namespace pb_profiler;
+
+extern "C" __attribute__((no_instrument_function)) void __cyg_profile_func_enter(void* function, void* call_site) {
+    pb_instrument_thread& state = pb_instrument_state;
+    if (!g_profiler.profiling || state.in_hook || !pb_instrument_included(state, (uint64_t)function)) {
+        return;
+    }
+    uint64_t stack_address = (uint64_t)__builtin_frame_address(0);
+    // Frames at or below this call's stack were left by a longjmp, their exits never come
+    while (state.depth > 0 && state.depth <= PB_INSTRUMENT_MAX_DEPTH &&
+           state.stack[state.depth - 1].stack_address <= stack_address) {
+        state.depth--;
+    }
+    if (state.depth < PB_INSTRUMENT_MAX_DEPTH) {
+        pb_instrument_frame& frame = state.stack[state.depth];
+        frame.function = (uint64_t)function;
+        frame.stack_address = stack_address;
+        frame.children = 0;
+        frame.start = __rdtsc();
+    }
+    state.depth++;
+}
+
+extern "C" __attribute__((no_instrument_function)) void __cyg_profile_func_exit(void* function, void* call_site) {
+    uint64_t end = __rdtsc();
+    pb_instrument_thread& state = pb_instrument_state;
+    // depth 0: entered before the profiler started
+    if (!g_profiler.profiling || state.in_hook || state.depth == 0 || !pb_instrument_included(state, (uint64_t)function)) {
+        return;
+    }
+    if (state.depth > PB_INSTRUMENT_MAX_DEPTH) {
+        state.depth--;
+        return;
+    }
+    // Drop frames whose exit was skipped (longjmp out of a deeper call). No frame
+    // at all means the call was entered before the profiler started.
+    uint64_t match = state.depth;
+    while (match > 0 && state.stack[match - 1].function != (uint64_t)function) {
+        match--;
+    }
+    if (match == 0) {
+        return;
+    }
+    state.depth = match - 1;
+    pb_instrument_frame& frame = state.stack[state.depth];
+    uint64_t total = end - frame.start;
+    uint64_t self = total > frame.children ? total - frame.children : 0;
+    if (state.depth > 0) {
+        state.stack[state.depth - 1].children += total;
+    }
+    state.in_hook = true;
+    pb_profile_function_event(frame.function, total, self);
+    state.in_hook = false;
+}
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <elf.h>
 #include <math.h>
 #define PROFILE_MANUAL
 #include "time_function.h"
@@ -9,10 +10,16 @@
 
 using namespace pb_profiler;
 
+// Metrics derived from the records of one scope, numbered after the record types
+enum pb_stats_metric {
+  // kept in thousandths, like PB_STATS_GB_PER_S
+  PB_STATS_CYCLES_PER_BYTE = PB_PROFILE_ANCHOR_LAST,
+  PB_STATS_GB_PER_S,
+  PB_STATS_ITEMS_PER_S,
+  PB_STATS_METRIC_LAST,
+};
 
-
-
-const char* pb_profile_anchor_type_to_string(pb_profile_anchor_result_type type) {
+const char* pb_profile_anchor_type_to_string(int type) {
   switch (type) {
     case PB_PROFILE_ANCHOR_CYCLES:
       return "cycles";
@@ -24,10 +31,63 @@ const char* pb_profile_anchor_type_to_string(pb_profile_anchor_result_type type)
       return "cache_misses";
     case PB_PROFILE_ANCHOR_BRANCH_MISSES:
       return "branch_misses";
+    case PB_PROFILE_ANCHOR_PAGE_FAULTS:
+      return "page_faults";
+    case PB_PROFILE_ANCHOR_ALLOC_SITE:
+      return "alloc_site";
+    case PB_PROFILE_ANCHOR_ALLOC_BYTES:
+      return "alloc_bytes";
+    case PB_PROFILE_ANCHOR_ALLOC_LIFETIME:
+      return "alloc_lifetime";
+    case PB_PROFILE_ANCHOR_TIMESTAMP:
+      return "timestamp";
+    case PB_PROFILE_ANCHOR_CPU:
+      return "cpu";
+    case PB_PROFILE_ANCHOR_TSC:
+      // converted to ns when the log is read
+      return "ns";
+    case PB_PROFILE_ANCHOR_LOCK_SITE:
+      return "lock_site";
+    case PB_PROFILE_ANCHOR_LOCK_WAIT:
+      return "lock_wait_ns";
+    case PB_PROFILE_ANCHOR_LOCK_HOLD:
+      return "lock_hold_ns";
+    case PB_PROFILE_ANCHOR_FUNCTION_SITE:
+      return "function_site";
+    case PB_PROFILE_ANCHOR_FUNCTION_TSC:
+      return "function_ns";
+    case PB_PROFILE_ANCHOR_FUNCTION_SELF_TSC:
+      // converted to ns when the log is read
+      return "self_ns";
+    case PB_PROFILE_ANCHOR_EXEMPLAR:
+      return "exemplar";
+    case PB_PROFILE_ANCHOR_EXEMPLAR_FRAME:
+      return "exemplar_frame";
+    case PB_PROFILE_ANCHOR_BYTES:
+      return "bytes";
+    case PB_PROFILE_ANCHOR_ITEMS:
+      return "items";
+    case PB_STATS_CYCLES_PER_BYTE:
+      return "cycles_per_byte";
+    case PB_STATS_GB_PER_S:
+      return "gb_per_s";
+    case PB_STATS_ITEMS_PER_S:
+      return "items_per_s";
   }
   return "unknown";
 }
 
+// Ratios below one need the fraction, they are stored in thousandths
+static std::string format_metric(int type, uint64_t value) {
+  char buffer[32];
+  if (type == PB_STATS_CYCLES_PER_BYTE || type == PB_STATS_GB_PER_S) {
+    snprintf(buffer, sizeof(buffer), "%.3f", value / 1000.0);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%lu", value);
+  }
+  return buffer;
+}
+
 std::string_view trim(std::string_view s)
 {
     s.remove_prefix(std::min(s.find_first_not_of(" \t\r\v\n"), s.size()));
@@ -36,7 +96,148 @@ std::string_view trim(std::string_view s)
     return s;
 }
 
-void print_results(const char* function, std::map<std::string, std::vector<std::vector<uint64_t>>> &per_function_results) {
+// Log-linear histogram for the streaming mode. Values below 2^PB_SKETCH_SUB_BITS
+// get a bucket each, above that every power of two is split in
+// 2^PB_SKETCH_SUB_BITS buckets, so a bucket is at most 1/128 of its lower
+// bound wide. A quantile picks the bucket holding the sample the exact mode
+// reports and returns its middle: exact below 128, within 0.4% above. Memory
+// is fixed (58KB) per anchor and metric, sketches merge by adding counts.
+#define PB_SKETCH_SUB_BITS 7
+#define PB_SKETCH_SUB_BUCKETS (1 << PB_SKETCH_SUB_BITS)
+#define PB_SKETCH_BUCKETS ((64 - PB_SKETCH_SUB_BITS + 1) * PB_SKETCH_SUB_BUCKETS)
+
+struct pb_sketch {
+  uint64_t count = 0;
+  double sum = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  // allocated on first add, empty sketches cost nothing
+  std::vector<uint64_t> buckets;
+
+  static inline uint64_t bucket(uint64_t value) {
+    if (value < PB_SKETCH_SUB_BUCKETS) {
+      return value;
+    }
+    uint64_t shift = 63 - __builtin_clzll(value) - PB_SKETCH_SUB_BITS;
+    return (shift + 1) * PB_SKETCH_SUB_BUCKETS + (value >> shift) - PB_SKETCH_SUB_BUCKETS;
+  }
+
+  inline void add(uint64_t value) {
+    if (buckets.empty()) {
+      buckets.resize(PB_SKETCH_BUCKETS);
+    }
+    buckets[bucket(value)]++;
+    count++;
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+  }
+
+  void merge(const pb_sketch& other) {
+    if (other.count == 0) {
+      return;
+    }
+    if (buckets.empty()) {
+      buckets.resize(PB_SKETCH_BUCKETS);
+    }
+    for (uint64_t i = 0; i < PB_SKETCH_BUCKETS; i++) {
+      buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  // Same rank as the exact mode, sorted[count * q]
+  uint64_t quantile(double q) const {
+    uint64_t rank = count * q;
+    uint64_t seen = 0;
+    for (uint64_t i = 0; i < PB_SKETCH_BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen <= rank) {
+        continue;
+      }
+      if (i < PB_SKETCH_SUB_BUCKETS) {
+        return i;
+      }
+      uint64_t shift = i / PB_SKETCH_SUB_BUCKETS - 1;
+      uint64_t lower = (i % PB_SKETCH_SUB_BUCKETS + PB_SKETCH_SUB_BUCKETS) << shift;
+      uint64_t middle = lower + (((uint64_t)1 << shift) - 1) / 2;
+      return std::max(min, std::min(max, middle));
+    }
+    return max;
+  }
+};
+
+// One of the slowest scopes as the profiler kept it, tsc already in ns
+struct pb_exemplar {
+  uint64_t timestamp;
+  uint64_t thread_id;
+  uint64_t cpu = UINT64_MAX;
+  uint64_t cycles = 0;
+  std::vector<std::pair<int, uint64_t>> values;
+  std::vector<uint64_t> frames;
+  std::vector<std::string> frame_names;
+};
+
+// Samples of one anchor, timestamps[type][i] is when the scope behind
+// values[type][i] ended, in ns since the log was opened. The streaming mode
+// only fills sketches.
+struct pb_function_results {
+  std::vector<uint64_t> values[PB_STATS_METRIC_LAST];
+  std::vector<uint64_t> timestamps[PB_STATS_METRIC_LAST];
+  pb_sketch sketches[PB_STATS_METRIC_LAST];
+  // Cycles per thread slot and per CPU for the imbalance report
+  std::map<uint64_t, pb_sketch> cycles_per_thread;
+  std::map<uint64_t, pb_sketch> cycles_per_cpu;
+  // Slowest scopes of every thread, only the PROFILE_EXEMPLARS slowest are printed
+  std::vector<pb_exemplar> exemplars;
+};
+typedef std::map<std::string, pb_function_results> pb_results_map;
+
+struct pb_stats_options {
+  // 0 disables the windowed report
+  uint64_t window_ns = 0;
+  const char* csv_path = NULL;
+  // A window is flagged when its p99 is this many times above or below the run median of window p99s
+  double spike_ratio = 2.0;
+  // Quantile sketches instead of every sample, memory doesn't grow with the logs
+  bool stream = false;
+  // Per thread and per CPU cycles breakdown
+  bool threads = false;
+};
+
+static inline void add_sample(pb_function_results& results, int type, uint64_t value, uint64_t timestamp, const pb_stats_options& options) {
+  if (options.stream) {
+    results.sketches[type].add(value);
+    return;
+  }
+  results.values[type].push_back(value);
+  results.timestamps[type].push_back(timestamp);
+}
+
+// Timestamps, thread slots and CPUs only line up within one process
+static inline void merge_results(pb_function_results& merged, const pb_function_results& results, bool same_process) {
+  for (int i = 0; i < PB_STATS_METRIC_LAST; i++) {
+    merged.values[i].insert(merged.values[i].end(), results.values[i].begin(), results.values[i].end());
+    if (same_process) {
+      merged.timestamps[i].insert(merged.timestamps[i].end(), results.timestamps[i].begin(), results.timestamps[i].end());
+    }
+    merged.sketches[i].merge(results.sketches[i]);
+  }
+  if (same_process) {
+    merged.exemplars.insert(merged.exemplars.end(), results.exemplars.begin(), results.exemplars.end());
+    for (auto& it : results.cycles_per_thread) {
+      merged.cycles_per_thread[it.first].merge(it.second);
+    }
+    for (auto& it : results.cycles_per_cpu) {
+      merged.cycles_per_cpu[it.first].merge(it.second);
+    }
+  }
+}
+
+void print_results(const char* function, pb_results_map &per_function_results) {
   auto stdev = [](std::vector<uint64_t>& values) {
     uint64_t sum = 0;
     for (int i = 0; i < values.size(); i++) {
@@ -59,52 +260,443 @@ void print_results(const char* function, std::map<std::string, std::vector<std::
 
   printf("Results %s:\n", function);
   for (auto it = per_function_results.begin(); it != per_function_results.end(); it++) {
+    bool empty = true;
+    for (int perf_type = 0; perf_type < PB_STATS_METRIC_LAST; perf_type++) {
+      empty &= it->second.values[perf_type].empty() && it->second.sketches[perf_type].count == 0;
+    }
+    // the events anchor only carries records that are moved to their sites
+    if (empty) {
+      continue;
+    }
     printf("Function %s:\n", it->first.c_str());
-    for (int perf_type = 0; perf_type < pb_profiler::PB_PROFILE_ANCHOR_LAST; perf_type++) {
-      if (it->second[perf_type].size() > 0) {
-        std::sort(it->second[perf_type].begin(), it->second[perf_type].end());
+    for (int perf_type = 0; perf_type < PB_STATS_METRIC_LAST; perf_type++) {
+      const pb_sketch& sketch = it->second.sketches[perf_type];
+      if (sketch.count > 0) {
+        printf("  %20s: samples: %15lu, p50: %15s p99 %15s\n",
+            pb_profile_anchor_type_to_string(perf_type),
+            sketch.count,
+            format_metric(perf_type, sketch.quantile(0.50)).c_str(),
+            format_metric(perf_type, sketch.quantile(0.99)).c_str());
+        continue;
+      }
+      std::vector<uint64_t>& values = it->second.values[perf_type];
+      if (values.size() > 0) {
+        // sorts a copy, timestamps stay aligned with the values for the windowed report
+        std::vector<uint64_t> sorted = values;
+        std::sort(sorted.begin(), sorted.end());
         uint64_t sum = 0;
-        for (int j = 0; j < it->second[perf_type].size(); j++) {
-          sum += it->second[perf_type][j];
+        for (int j = 0; j < sorted.size(); j++) {
+          sum += sorted[j];
         }
         // print boxplot
-        printf("  %20s: samples: %15lu, p50: %15lu p99 %15lu\n", 
-            pb_profile_anchor_type_to_string((pb_profiler::pb_profile_anchor_result_type)perf_type), 
-            it->second[perf_type].size(), 
-            p50(it->second[perf_type]), 
-            p99(it->second[perf_type]));
+        printf("  %20s: samples: %15lu, p50: %15s p99 %15s\n", 
+            pb_profile_anchor_type_to_string(perf_type), 
+            sorted.size(), 
+            format_metric(perf_type, p50(sorted)).c_str(), 
+            format_metric(perf_type, p99(sorted)).c_str());
+      }
+    }
+    std::vector<pb_exemplar>& exemplars = it->second.exemplars;
+    if (!exemplars.empty()) {
+      std::sort(exemplars.begin(), exemplars.end(), [](const pb_exemplar& a, const pb_exemplar& b) { return a.cycles > b.cycles; });
+      printf("  slowest:\n");
+      for (uint64_t i = 0; i < exemplars.size() && i < PROFILE_EXEMPLARS; i++) {
+        pb_exemplar& exemplar = exemplars[i];
+        printf("    at %.3f ms thread %lu", exemplar.timestamp / 1e6, exemplar.thread_id);
+        if (exemplar.cpu != UINT64_MAX) {
+          printf(" cpu %lu", exemplar.cpu);
+        }
+        for (auto& value : exemplar.values) {
+          printf(" %s %s", pb_profile_anchor_type_to_string(value.first), format_metric(value.first, value.second).c_str());
+        }
+        printf("\n");
+        for (std::string& frame : exemplar.frame_names) {
+          printf("      %s\n", frame.c_str());
+        }
+      }
+    }
+  }
+}
+struct pb_mapping {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  std::string path;
+};
+
+std::vector<pb_mapping> parse_maps(const std::string& maps) {
+  std::vector<pb_mapping> mappings;
+  size_t line_start = 0;
+  while (line_start < maps.size()) {
+    size_t line_end = maps.find('\n', line_start);
+    if (line_end == std::string::npos) {
+      line_end = maps.size();
+    }
+    std::string line = maps.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    pb_mapping mapping;
+    char perms[8];
+    int path_start = 0;
+    if (sscanf(line.c_str(), "%lx-%lx %7s %lx %*s %*u %n", &mapping.start, &mapping.end, perms, &mapping.offset, &path_start) < 4) {
+      continue;
+    }
+    // only executable file mappings hold code
+    if (perms[2] != 'x' || path_start == 0 || line[path_start] != '/') {
+      continue;
+    }
+    mapping.path = line.substr(path_start);
+    mappings.push_back(mapping);
+  }
+  return mappings;
+}
+
+// File offset to the link time address through the PT_LOAD segments, it is
+// what addr2line expects for PIE executables and shared libraries alike
+bool elf_file_offset_to_vaddr(const std::string& path, uint64_t file_offset, uint64_t* vaddr) {
+  static std::map<std::string, std::vector<Elf64_Phdr>> loads_per_path;
+  auto it = loads_per_path.find(path);
+  if (it == loads_per_path.end()) {
+    std::vector<Elf64_Phdr> loads;
+    FILE* elf = fopen(path.c_str(), "r");
+    Elf64_Ehdr ehdr;
+    if (elf != NULL && fread(&ehdr, sizeof(ehdr), 1, elf) == 1 &&
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 && ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
+      for (int i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr phdr;
+        if (fseek(elf, ehdr.e_phoff + i * ehdr.e_phentsize, SEEK_SET) != 0 || fread(&phdr, sizeof(phdr), 1, elf) != 1) {
+          break;
+        }
+        if (phdr.p_type == PT_LOAD) {
+          loads.push_back(phdr);
+        }
+      }
+    }
+    if (elf != NULL) {
+      fclose(elf);
+    }
+    it = loads_per_path.emplace(path, loads).first;
+  }
+  for (const Elf64_Phdr& phdr : it->second) {
+    if (file_offset >= phdr.p_offset && file_offset < phdr.p_offset + phdr.p_filesz) {
+      *vaddr = file_offset - phdr.p_offset + phdr.p_vaddr;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runtime addresses to "function (file:line)" with one addr2line run per
+// binary, unresolved addresses stay in hex
+std::map<uint64_t, std::string> symbolize(const std::vector<pb_mapping>& mappings, const std::vector<uint64_t>& addresses) {
+  std::map<uint64_t, std::string> names;
+  std::map<std::string, std::vector<std::pair<uint64_t, uint64_t>>> per_path;
+  for (uint64_t address : addresses) {
+    char hex[32];
+    snprintf(hex, sizeof(hex), "%#lx", address);
+    names[address] = hex;
+    for (const pb_mapping& mapping : mappings) {
+      uint64_t vaddr;
+      if (address >= mapping.start && address < mapping.end &&
+          elf_file_offset_to_vaddr(mapping.path, address - mapping.start + mapping.offset, &vaddr)) {
+        per_path[mapping.path].push_back({address, vaddr});
+        break;
+      }
+    }
+  }
+  const uint64_t batch = 256;
+  for (auto& it : per_path) {
+    for (uint64_t first = 0; first < it.second.size(); first += batch) {
+      uint64_t last = std::min<uint64_t>(first + batch, it.second.size());
+      // -a starts every address with its own line, -i adds the frames it is inlined in
+      std::string command = "addr2line -a -i -f -C -e '" + it.first + "'";
+      for (uint64_t i = first; i < last; i++) {
+        char hex[32];
+        snprintf(hex, sizeof(hex), " %#lx", it.second[i].second);
+        command += hex;
+      }
+      FILE* pipe = popen(command.c_str(), "r");
+      if (pipe == NULL) {
+        continue;
+      }
+      // frames[i] is innermost first: function, location
+      std::vector<std::vector<std::pair<std::string, std::string>>> frames;
+      char line[4096];
+      char location[4096];
+      while (fgets(line, sizeof(line), pipe) != NULL) {
+        if (strncmp(line, "0x", 2) == 0) {
+          frames.emplace_back();
+          continue;
+        }
+        if (frames.empty() || fgets(location, sizeof(location), pipe) == NULL) {
+          break;
+        }
+        frames.back().push_back({std::string(trim(line)), std::string(trim(location))});
+      }
+      auto frame_name = [&](const std::pair<std::string, std::string>& frame) {
+        std::string location_str = frame.second;
+        if (location_str.rfind("??", 0) == 0) {
+          location_str = it.first.substr(it.first.rfind('/') + 1);
+        }
+        return frame.first + " (" + location_str + ")";
+      };
+      for (uint64_t i = first; i < last && i - first < frames.size(); i++) {
+        auto& address_frames = frames[i - first];
+        if (address_frames.empty() || address_frames[0].first == "??") {
+          continue;
+        }
+        // inlined profiler or standard library code, e.g. a lock_guard constructor, is named by
+        // the first frame outside of it, the line that declared it
+        uint64_t site = 0;
+        for (uint64_t frame = 0; frame < address_frames.size(); frame++) {
+          const std::string& location_str = address_frames[frame].second;
+          std::string file = location_str.substr(0, location_str.rfind(':'));
+          bool profiler = file == "time_function.h" ||
+                          (file.size() > 16 && file.compare(file.size() - 16, 16, "/time_function.h") == 0);
+          bool standard = file.rfind("/usr/include/", 0) == 0 || file.find("/include/c++/") != std::string::npos;
+          if (!profiler && !standard) {
+            site = frame;
+            break;
+          }
+        }
+        std::string name = frame_name(address_frames[site]);
+        if (site + 1 < address_frames.size()) {
+          name += " inlined in " + frame_name(address_frames.back());
+        }
+        names[it.second[i].first] = name;
+      }
+      pclose(pipe);
+    }
+  }
+  return names;
+}
+
+static std::string csv_quote(const std::string& value) {
+  std::string quoted = "\"";
+  for (char c : value) {
+    if (c == '"') {
+      quoted += '"';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+// p50/p99/max of every anchor and metric per window, windows whose p99 is
+// spike_ratio away from the median window p99 of the run are flagged
+void print_windows(const char* filename, pb_results_map& per_function_results, const pb_stats_options& options, FILE* csv) {
+  printf("Windows %s (%lu ms):\n", filename, options.window_ns / 1000000);
+  for (auto& it : per_function_results) {
+    for (int perf_type = 0; perf_type < PB_STATS_METRIC_LAST; perf_type++) {
+      std::vector<uint64_t>& values = it.second.values[perf_type];
+      std::vector<uint64_t>& timestamps = it.second.timestamps[perf_type];
+      // allocation records carry no timestamp
+      if (values.empty() || timestamps.size() != values.size()) {
+        continue;
+      }
+      std::map<uint64_t, std::vector<uint64_t>> per_window;
+      for (uint64_t i = 0; i < values.size(); i++) {
+        per_window[timestamps[i] / options.window_ns].push_back(values[i]);
       }
+      struct window_stats {
+        uint64_t window;
+        uint64_t samples;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t max;
+      };
+      std::vector<window_stats> windows;
+      std::vector<uint64_t> p99s;
+      for (auto& window : per_window) {
+        std::vector<uint64_t>& window_values = window.second;
+        std::sort(window_values.begin(), window_values.end());
+        window_stats stats;
+        stats.window = window.first;
+        stats.samples = window_values.size();
+        stats.p50 = window_values[window_values.size() * 0.50];
+        stats.p99 = window_values[window_values.size() * 0.99];
+        stats.max = window_values.back();
+        windows.push_back(stats);
+        p99s.push_back(stats.p99);
+      }
+      std::sort(p99s.begin(), p99s.end());
+      double median_p99 = p99s[p99s.size() / 2];
+      const char* metric = pb_profile_anchor_type_to_string(perf_type);
+      for (window_stats& stats : windows) {
+        bool flagged = stats.p99 > median_p99 * options.spike_ratio || stats.p99 * options.spike_ratio < median_p99;
+        double start_ms = (double)(stats.window * options.window_ns) / 1e6;
+        if (flagged) {
+          printf("  spike %s %s at %.0f ms: samples %lu p50 %s p99 %s max %s, run median p99 %s\n",
+              it.first.c_str(), metric, start_ms, stats.samples, format_metric(perf_type, stats.p50).c_str(),
+              format_metric(perf_type, stats.p99).c_str(), format_metric(perf_type, stats.max).c_str(),
+              format_metric(perf_type, median_p99).c_str());
+        }
+        if (csv != NULL) {
+          fprintf(csv, "%s,%s,%s,%.3f,%lu,%s,%s,%s,%d\n", csv_quote(filename).c_str(), csv_quote(it.first).c_str(),
+              metric, start_ms, stats.samples, format_metric(perf_type, stats.p50).c_str(), format_metric(perf_type, stats.p99).c_str(),
+              format_metric(perf_type, stats.max).c_str(), flagged ? 1 : 0);
+        }
+      }
+    }
+  }
+}
+
+// Which threads (and CPUs) an anchor's cycles went to: share of the total,
+// p50/p99 per thread, spread of p99 across threads and max/mean imbalance
+void print_imbalance(const char* filename, pb_results_map& per_function_results) {
+  printf("Threads %s:\n", filename);
+  for (auto& it : per_function_results) {
+    auto print_breakdown = [&](const char* kind, std::map<uint64_t, pb_sketch>& per_key) {
+      if (per_key.size() < 2) {
+        return;
+      }
+      double total = 0;
+      std::vector<std::pair<uint64_t, const pb_sketch*>> sorted;
+      std::vector<uint64_t> p99s;
+      for (auto& key : per_key) {
+        total += key.second.sum;
+        sorted.push_back({key.first, &key.second});
+        p99s.push_back(key.second.quantile(0.99));
+      }
+      std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.second->sum > b.second->sum; });
+      std::sort(p99s.begin(), p99s.end());
+      double mean = total / sorted.size();
+      printf("Function %s: %lu %ss, cycles %.0f, imbalance max/mean %.2f, p99 across %ss min %lu median %lu max %lu\n",
+          it.first.c_str(), sorted.size(), kind, total, sorted[0].second->sum / mean, kind,
+          p99s.front(), p99s[p99s.size() / 2], p99s.back());
+      for (auto& key : sorted) {
+        printf("  %6s %4lu: samples: %12lu, share: %6.2f%%, p50: %15lu p99 %15lu\n", kind, key.first,
+            key.second->count, 100.0 * key.second->sum / total, key.second->quantile(0.50), key.second->quantile(0.99));
+      }
+    };
+    print_breakdown("thread", it.second.cycles_per_thread);
+    print_breakdown("cpu", it.second.cycles_per_cpu);
+  }
+}
+
+// The sketch of one metric whichever mode filled it
+static pb_sketch sketch_of(const pb_function_results& results, int type) {
+  if (results.sketches[type].count > 0) {
+    return results.sketches[type];
+  }
+  pb_sketch sketch;
+  for (uint64_t value : results.values[type]) {
+    sketch.add(value);
+  }
+  return sketch;
+}
+
+// Lock sites ranked by total wait, with the share of contended acquires
+// (uncontended ones record a wait of 0) and wait/hold percentiles
+void print_locks(const char* filename, pb_results_map& per_function_results) {
+  struct lock_stats {
+    const std::string* name;
+    pb_sketch wait;
+    pb_sketch hold;
+  };
+  std::vector<lock_stats> locks;
+  for (auto& it : per_function_results) {
+    pb_sketch wait = sketch_of(it.second, PB_PROFILE_ANCHOR_LOCK_WAIT);
+    if (wait.count > 0) {
+      locks.push_back({&it.first, wait, sketch_of(it.second, PB_PROFILE_ANCHOR_LOCK_HOLD)});
     }
   }
+  if (locks.empty()) {
+    return;
+  }
+  std::sort(locks.begin(), locks.end(), [](const lock_stats& a, const lock_stats& b) { return a.wait.sum > b.wait.sum; });
+  printf("Locks %s:\n", filename);
+  for (lock_stats& lock : locks) {
+    uint64_t contended = lock.wait.count - lock.wait.buckets[0];
+    printf("%s:\n  acquires: %12lu, contended: %6.2f%%, total wait: %15.0f ns, wait p50: %12lu p99 %12lu, hold p50: %12lu p99 %12lu\n",
+        lock.name->c_str(), lock.wait.count, 100.0 * contended / lock.wait.count, lock.wait.sum,
+        lock.wait.quantile(0.50), lock.wait.quantile(0.99), lock.hold.quantile(0.50), lock.hold.quantile(0.99));
+  }
 }
-void parse_stats(const char* filename, std::map<std::string, std::vector<std::vector<uint64_t>>> &per_function_results_all) {
+
+// tsc ticks to ns with the kernel's perf parameters (split like the
+// perf_event_mmap_page example so ticks * time_mult can't overflow),
+// otherwise with the rate calibrated when the log was opened
+static inline uint64_t tsc_to_ns(const pb_profile_log_header& log_header, uint64_t ticks) {
+  if (log_header.cap_user_time) {
+    uint64_t quot = ticks >> log_header.time_shift;
+    uint64_t rem = ticks & (((uint64_t)1 << log_header.time_shift) - 1);
+    return quot * log_header.time_mult + ((rem * log_header.time_mult) >> log_header.time_shift);
+  }
+  return log_header.tsc_hz > 0 ? (uint64_t)((double)ticks * 1e9 / (double)log_header.tsc_hz) : 0;
+}
+
+void parse_stats(const char* filename, pb_results_map &per_function_results_all, const pb_stats_options& options, FILE* csv) {
   FILE* file = fopen(filename, "r");
   if (file == NULL) {
     printf("Error: file not found\n");
     return;
   }
-  Arena* arena = arena_create(1024*1024, true);
+  pb_profile_log_header log_header;
+  if (fread(&log_header, sizeof(pb_profile_log_header), 1, file) != 1 ||
+      log_header.magic != PROFILE_LOG_MAGIC || log_header.version != PROFILE_LOG_VERSION) {
+    printf("Error: %s is not a version %d profile log\n", filename, PROFILE_LOG_VERSION);
+    fclose(file);
+    return;
+  }
+  if (log_header.cap_user_time) {
+    printf("ns from perf tsc conversion, mult %u shift %u\n", log_header.time_mult, log_header.time_shift);
+  } else {
+    printf("ns from calibrated tsc, %lu Hz\n", log_header.tsc_hz);
+  }
+  std::string maps(log_header.maps_length, '\0');
+  if (fread(&maps[0], 1, log_header.maps_length, file) != log_header.maps_length) {
+    printf("Error: could not read maps\n");
+    fclose(file);
+    return;
+  }
+  // Reused for every block, only the samples (or sketches) outlive it
+  std::vector<char> name_buffer;
+  std::vector<char> results_buffer;
 
   pb_profile_anchor_result result;
   pb_profile_flush_header header;
   int ret;
-  std::map<std::string, std::vector<std::vector<uint64_t>>> per_function_results;
+  pb_results_map per_function_results;
+  // Address anchors and allocation sites are named after symbolization
+  std::map<uint64_t, pb_function_results> per_address_results;
+  std::map<uint64_t, pb_function_results> per_alloc_site_results;
+  std::map<uint64_t, pb_function_results> per_lock_site_results;
+  std::map<uint64_t, pb_function_results> per_function_site_results;
+  // Last allocation, lock and function site record per thread, their value records may land in the next block
+  std::map<uint64_t, uint64_t> alloc_site_per_thread;
+  std::map<uint64_t, uint64_t> lock_site_per_thread;
+  std::map<uint64_t, uint64_t> function_site_per_thread;
+  // every allocation, lock and instrumented function is reported as its own function, without timestamps
+  auto add_site_sample = [&](pb_function_results& site_results, int type, uint64_t value) {
+    if (options.stream) {
+      site_results.sketches[type].add(value);
+    } else {
+      site_results.values[type].push_back(value);
+    }
+  };
+  // The records of a scope follow its timestamp, state of the last scope per anchor and thread
+  struct pb_scope_state {
+    uint64_t timestamp = 0;
+    uint64_t cpu = UINT64_MAX;
+    uint64_t cycles = 0;
+    uint64_t ns = 0;
+  };
+  std::map<std::pair<pb_function_results*, uint64_t>, pb_scope_state> scope_per_anchor_thread;
   while (fread(&header, sizeof(pb_profile_flush_header), 1, file) == 1) {
     // printf("Thread %lu amount %lu\n", header.thread_id, header.result_amount);
-    char* function = (char*)arena_alloc(arena, header.name_length);
+    name_buffer.resize(header.name_length + 1);
+    char* function = name_buffer.data();
     ret = fread(function, 1, header.name_length, file);
     if (ret != header.name_length) {
       uint64_t pos = ftell(file);
       printf("Error: could not read function %d pos: %lu\n", ret, pos);
       break;
     }
+    function[header.name_length] = '\0';
     // printf("Function %s:\n", function);
 
-    char* results_raw = (char*)arena_alloc(arena, header.result_amount);
-    if (results_raw == NULL) {
-      printf("Error: could not allocate memory\n");
-      break;
-    }
+    results_buffer.resize(header.result_amount);
+    char* results_raw = results_buffer.data();
 
     {
       // read results
@@ -117,44 +709,237 @@ void parse_stats(const char* filename, std::map<std::string, std::vector<std::ve
         buf_size = BUFSIZ < amount_left_to_read ? BUFSIZ : amount_left_to_read;
       }
     }
-    if (per_function_results.find(function) == per_function_results.end()) {
-      std::string_view function_str(function);
-      function_str =  trim(function_str);
-      printf("Adding function %s\n", function_str.data());
-      per_function_results[function_str.data()] = std::vector<std::vector<uint64_t>>(PB_PROFILE_ANCHOR_LAST);
+    // one map lookup per flushed block instead of one per sample
+    pb_function_results* function_results;
+    if (header.name_length == 0) {
+      function_results = &per_address_results[header.address];
+    } else {
+      std::string function_str(trim(function));
+      if (per_function_results.find(function_str) == per_function_results.end()) {
+        printf("Adding function %s\n", function_str.c_str());
+      }
+      function_results = &per_function_results[function_str];
     }
+    pb_scope_state& scope = scope_per_anchor_thread[{function_results, header.thread_id}];
     pb_profile_anchor_result* results = (pb_profile_anchor_result*)results_raw;
-    for (int i = 0; i < header.result_amount / sizeof(pb_profile_anchor_result); i++) {
+    uint64_t result_count = header.result_amount / sizeof(pb_profile_anchor_result);
+    // Blocks of exemplars start with one, nothing in them is a regular sample
+    if (result_count > 0 && results[0].type == PB_PROFILE_ANCHOR_EXEMPLAR) {
+      for (uint64_t i = 0; i < result_count; i++) {
+        result = results[i];
+        if (result.type == PB_PROFILE_ANCHOR_EXEMPLAR) {
+          pb_exemplar exemplar;
+          exemplar.timestamp = result.value > log_header.tsc_start ? tsc_to_ns(log_header, result.value - log_header.tsc_start) : 0;
+          exemplar.thread_id = header.thread_id;
+          function_results->exemplars.push_back(exemplar);
+          continue;
+        }
+        pb_exemplar& exemplar = function_results->exemplars.back();
+        if (result.type == PB_PROFILE_ANCHOR_EXEMPLAR_FRAME) {
+          exemplar.frames.push_back(result.value);
+        } else if (result.type == PB_PROFILE_ANCHOR_CPU) {
+          exemplar.cpu = result.value;
+        } else {
+          if (result.type == PB_PROFILE_ANCHOR_CYCLES) {
+            exemplar.cycles = result.value;
+          }
+          exemplar.values.push_back({result.type, result.type == PB_PROFILE_ANCHOR_TSC ? tsc_to_ns(log_header, result.value) : result.value});
+        }
+      }
+      continue;
+    }
+    for (int i = 0; i < result_count; i++) {
       result = results[i];
-      per_function_results[function][result.type].push_back(result.value);
+      if (result.type == PB_PROFILE_ANCHOR_TIMESTAMP) {
+        scope = pb_scope_state();
+        scope.timestamp = result.value > log_header.tsc_start ? tsc_to_ns(log_header, result.value - log_header.tsc_start) : 0;
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_CPU) {
+        scope.cpu = result.value;
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_TSC) {
+        result.value = tsc_to_ns(log_header, result.value);
+        scope.ns = result.value;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_CYCLES) {
+        scope.cycles = result.value;
+      }
+      // cycles and ns come first in a scope, the payload last
+      if (result.type == PB_PROFILE_ANCHOR_BYTES && result.value > 0) {
+        if (scope.cycles > 0) {
+          add_sample(*function_results, PB_STATS_CYCLES_PER_BYTE, scope.cycles * 1000 / result.value, scope.timestamp, options);
+        }
+        if (scope.ns > 0) {
+          // bytes per ns is GB/s
+          add_sample(*function_results, PB_STATS_GB_PER_S, result.value * 1000 / scope.ns, scope.timestamp, options);
+        }
+      }
+      if (result.type == PB_PROFILE_ANCHOR_ITEMS && result.value > 0 && scope.ns > 0) {
+        add_sample(*function_results, PB_STATS_ITEMS_PER_S, (uint64_t)((double)result.value * 1e9 / scope.ns), scope.timestamp, options);
+      }
+      if (result.type == PB_PROFILE_ANCHOR_ALLOC_SITE) {
+        alloc_site_per_thread[header.thread_id] = result.value;
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_ALLOC_BYTES || result.type == PB_PROFILE_ANCHOR_ALLOC_LIFETIME) {
+        add_site_sample(per_alloc_site_results[alloc_site_per_thread[header.thread_id]], result.type, result.value);
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_FUNCTION_SITE) {
+        function_site_per_thread[header.thread_id] = result.value;
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_FUNCTION_TSC || result.type == PB_PROFILE_ANCHOR_FUNCTION_SELF_TSC) {
+        // inclusive time is reported as the usual ns metric
+        int type = result.type == PB_PROFILE_ANCHOR_FUNCTION_TSC ? PB_PROFILE_ANCHOR_TSC : PB_PROFILE_ANCHOR_FUNCTION_SELF_TSC;
+        add_site_sample(per_function_site_results[function_site_per_thread[header.thread_id]], type, tsc_to_ns(log_header, result.value));
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_LOCK_SITE) {
+        lock_site_per_thread[header.thread_id] = result.value;
+        continue;
+      }
+      if (result.type == PB_PROFILE_ANCHOR_LOCK_WAIT || result.type == PB_PROFILE_ANCHOR_LOCK_HOLD) {
+        uint64_t ns = tsc_to_ns(log_header, result.value);
+        // a contended wait stays non zero after rounding
+        if (result.type == PB_PROFILE_ANCHOR_LOCK_WAIT && result.value > 0 && ns == 0) {
+          ns = 1;
+        }
+        add_site_sample(per_lock_site_results[lock_site_per_thread[header.thread_id]], result.type, ns);
+        continue;
+      }
+      add_sample(*function_results, result.type, result.value, scope.timestamp, options);
+      if (options.threads && result.type == PB_PROFILE_ANCHOR_CYCLES) {
+        function_results->cycles_per_thread[header.thread_id].add(result.value);
+        if (scope.cpu != UINT64_MAX) {
+          function_results->cycles_per_cpu[scope.cpu].add(result.value);
+        }
+      }
       // printf("  %s: %lu\n", pb_profile_anchor_type_to_string(result.type), result.value);
     }
   }
 
+  {
+    // Addresses only mean something within this process, resolve them before merging
+    std::vector<pb_mapping> mappings = parse_maps(maps);
+    std::vector<uint64_t> addresses;
+    for (auto& it : per_address_results) {
+      addresses.push_back(it.first);
+    }
+    // Allocation and lock sites are return addresses, the call is the instruction before
+    for (auto& it : per_alloc_site_results) {
+      addresses.push_back(it.first - 1);
+    }
+    for (auto& it : per_lock_site_results) {
+      addresses.push_back(it.first - 1);
+    }
+    // Instrumented functions are their entry address
+    for (auto& it : per_function_site_results) {
+      addresses.push_back(it.first);
+    }
+    // Exemplar frames are return addresses too
+    std::vector<pb_exemplar*> exemplars;
+    for (auto& it : per_function_results) {
+      for (pb_exemplar& exemplar : it.second.exemplars) {
+        exemplars.push_back(&exemplar);
+      }
+    }
+    for (auto& it : per_address_results) {
+      for (pb_exemplar& exemplar : it.second.exemplars) {
+        exemplars.push_back(&exemplar);
+      }
+    }
+    for (pb_exemplar* exemplar : exemplars) {
+      for (uint64_t frame : exemplar->frames) {
+        addresses.push_back(frame - 1);
+      }
+    }
+    std::map<uint64_t, std::string> names = symbolize(mappings, addresses);
+    for (pb_exemplar* exemplar : exemplars) {
+      for (uint64_t frame : exemplar->frames) {
+        exemplar->frame_names.push_back(names[frame - 1]);
+      }
+    }
+    auto merge = [&](const std::string& name, pb_function_results& results) {
+      merge_results(per_function_results[name], results, true);
+    };
+    for (auto& it : per_address_results) {
+      merge(names[it.first], it.second);
+    }
+    for (auto& it : per_alloc_site_results) {
+      merge("alloc site " + names[it.first - 1], it.second);
+    }
+    for (auto& it : per_lock_site_results) {
+      merge("lock site " + names[it.first - 1], it.second);
+    }
+    for (auto& it : per_function_site_results) {
+      merge("function " + names[it.first], it.second);
+    }
+  }
+
   print_results(filename, per_function_results);
+  if (options.window_ns > 0) {
+    print_windows(filename, per_function_results, options, csv);
+  }
+  if (options.threads) {
+    print_imbalance(filename, per_function_results);
+  }
+  print_locks(filename, per_function_results);
 
+  // Timestamps of different processes don't line up, only values are merged
   for (auto &function_results : per_function_results) {
-    if (per_function_results_all.find(function_results.first) == per_function_results_all.end()) {
-      per_function_results_all[function_results.first] = std::vector<std::vector<uint64_t>>(PB_PROFILE_ANCHOR_LAST);
-    }
-    for (int i = 0; i < PB_PROFILE_ANCHOR_LAST; i++) {
-      per_function_results_all[function_results.first][i].insert(per_function_results_all[function_results.first][i].end(), function_results.second[i].begin(), function_results.second[i].end());
-    }
+    merge_results(per_function_results_all[function_results.first], function_results.second, false);
   }
   fclose(file);
   printf("Done\n");
-  arena_destroy(arena);
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    printf("Usage: %s <profile.log>...\n", argv[0]);
+  pb_stats_options options;
+  std::vector<const char*> logs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--window-ms") == 0 && i + 1 < argc) {
+      options.window_ns = strtoull(argv[++i], NULL, 10) * 1000000;
+    } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+      options.csv_path = argv[++i];
+    } else if (strcmp(argv[i], "--spike-ratio") == 0 && i + 1 < argc) {
+      options.spike_ratio = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      options.stream = true;
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      options.threads = true;
+    } else {
+      logs.push_back(argv[i]);
+    }
+  }
+  // windows need every sample with its timestamp
+  if (logs.empty() || (options.stream && (options.window_ns > 0 || options.csv_path != NULL))) {
+    printf("Usage: %s [--threads] [--window-ms ms] [--csv file] [--spike-ratio ratio] <profile.log>...\n", argv[0]);
+    printf("       %s --stream [--threads] <profile.log>...\n", argv[0]);
     return 1;
   }
-  std::map<std::string, std::vector<std::vector<uint64_t>>> per_function_results_all;
-  for (int i = 1; i < argc; i++) {
-    parse_stats(argv[i], per_function_results_all);
+  FILE* csv = NULL;
+  if (options.csv_path != NULL) {
+    if (options.window_ns == 0) {
+      options.window_ns = 1000 * 1000000ULL;
+    }
+    csv = fopen(options.csv_path, "w");
+    if (csv == NULL) {
+      printf("Error: fopen() failed csv file %s\n", options.csv_path);
+      return 1;
+    }
+    fprintf(csv, "log,anchor,metric,window_start_ms,samples,p50,p99,max,flagged\n");
+  }
+  pb_results_map per_function_results_all;
+  for (const char* log : logs) {
+    parse_stats(log, per_function_results_all, options, csv);
   }
   print_results("All", per_function_results_all);
+  print_locks("All", per_function_results_all);
+  if (csv != NULL) {
+    fclose(csv);
+  }
   return 0;
 }